@@ -0,0 +1,124 @@
+// Microbenchmark for the hex conversions in utils.cpp, against the
+// stringstream / substr+stoi versions they replaced. Built at -O3 by
+// `make bench`.
+#include "../include/object_id.h"
+#include "../include/utils.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// ---------------------------------------------------------------------------
+// Previous implementations
+// ---------------------------------------------------------------------------
+
+static std::string old_binaryToHex(const std::string &binary) {
+  const unsigned char *data =
+      reinterpret_cast<const unsigned char *>(binary.c_str());
+  std::stringstream ss;
+  for (size_t i = 0; i < binary.size(); i++) {
+    ss << std::hex << std::setw(2) << std::setfill('0')
+       << static_cast<int>(data[i]);
+  }
+  return ss.str();
+}
+
+static std::string old_hexToBinary(const std::string &hex) {
+  std::string binary;
+  for (size_t i = 0; i < hex.length(); i += 2) {
+    std::string byteString = hex.substr(i, 2);
+    char byte = static_cast<char>(std::stoi(byteString, nullptr, 16));
+    binary.push_back(byte);
+  }
+  return binary;
+}
+
+// ---------------------------------------------------------------------------
+// Harness
+// ---------------------------------------------------------------------------
+
+// Keeps results alive so the compiler cannot drop the work
+static size_t sink = 0;
+
+// Nanoseconds per call of `fn` over all `inputs`, best of five runs
+template <typename Fn>
+static double time_per_call(const std::vector<std::string> &inputs, Fn fn) {
+  double best = 1e300;
+  for (int run = 0; run < 5; run++) {
+    size_t calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto now = start;
+    do {
+      for (const auto &in : inputs)
+        sink += fn(in).size();
+      calls += inputs.size();
+      now = std::chrono::steady_clock::now();
+    } while (now - start < std::chrono::milliseconds(100));
+    double ns = std::chrono::duration<double, std::nano>(now - start).count();
+    best = std::min(best, ns / calls);
+  }
+  return best;
+}
+
+static std::vector<std::string> random_inputs(size_t bytes, size_t count) {
+  std::mt19937_64 rng(42);
+  std::vector<std::string> out(count);
+  for (auto &s : out) {
+    s.resize(bytes);
+    for (auto &c : s)
+      c = static_cast<char>(rng());
+  }
+  return out;
+}
+
+static bool report(const char *name, size_t bytes, double oldNs,
+                   double newNs, double target) {
+  double speedup = oldNs / newNs;
+  std::printf("%-12s %6zu bytes  old %9.1f ns  new %7.1f ns  %6.1fx%s\n",
+              name, bytes, oldNs, newNs, speedup,
+              speedup < target ? "  (below target)" : "");
+  return speedup >= target;
+}
+
+int main(int argc, char *argv[]) {
+  double target = argc > 1 ? std::atof(argv[1]) : 20.0;
+  bool ok = true;
+
+  for (size_t bytes : {size_t(20), size_t(64), size_t(4096)}) {
+    std::vector<std::string> raw = random_inputs(bytes, 256);
+    std::vector<std::string> hex;
+    for (const auto &r : raw) {
+      hex.push_back(binaryToHex(r));
+      if (hex.back() != old_binaryToHex(r) || hexToBinary(hex.back()) != r ||
+          old_hexToBinary(hex.back()) != r) {
+        std::fprintf(stderr, "mismatch at %zu bytes\n", bytes);
+        return EXIT_FAILURE;
+      }
+    }
+
+    ok &= report("binaryToHex", bytes, time_per_call(raw, old_binaryToHex),
+                 time_per_call(raw, binaryToHex), target);
+    ok &= report("hexToBinary", bytes, time_per_call(hex, old_hexToBinary),
+                 time_per_call(hex, hexToBinary), target);
+  }
+
+  // Object names, the common case, without building std::strings
+  std::vector<std::string> names;
+  for (const auto &r : random_inputs(ObjectId::RAW_SIZE, 256))
+    names.push_back(binaryToHex(r));
+  ok &= report("from_hex", ObjectId::RAW_SIZE,
+               time_per_call(names, old_hexToBinary),
+               time_per_call(names,
+                             [](const std::string &h) {
+                               return ObjectId::from_hex(h).raw();
+                             }),
+               target);
+
+  // A shortfall is reported, not failed: timings vary with the machine
+  std::printf("target %.0fx: %s\n", target, ok ? "met" : "NOT met");
+  return sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,19 +1,95 @@
 #pragma once
+#include "object_id.h"
+#include <cstdint>
 #include <filesystem>
+#include <map>
 #include <string>
 #include <vector>
 
 struct IndexEntry {
   std::string mode;
-  std::string sha_hex;
+  ObjectId oid;
   std::string path;
+
+  // Stat data recorded when the blob was hashed; an unchanged stat means
+  // the file does not need to be read again
+  uint32_t ctime_sec = 0;
+  uint32_t ctime_nsec = 0;
+  uint32_t mtime_sec = 0;
+  uint32_t mtime_nsec = 0;
+  uint32_t dev = 0;
+  uint32_t ino = 0;
+  uint32_t uid = 0;
+  uint32_t gid = 0;
+  uint32_t size = 0;
+};
+
+// Cached tree ("TREE" index extension): the tree object of each directory
+// whose entries are unchanged since the tree was last written
+struct CacheTree {
+  int entryCount = -1; // index entries below this directory; -1 = invalid
+  ObjectId oid;
+  std::map<std::string, CacheTree> children;
+};
+
+// The staging area, kept sorted by path (the order Git writes it in) so a
+// lookup is a binary search and a batch of updates is a single merge
+class Index {
+public:
+  Index() = default;
+  explicit Index(std::vector<IndexEntry> entries);
+
+  const IndexEntry *find(const std::string &path) const;
+
+  // Inserts or replaces every entry of `batch` (last one wins for duplicate
+  // paths) in O(n + k log k)
+  void update(std::vector<IndexEntry> batch);
+  void remove(std::vector<std::string> paths);
+
+  // Marks every directory on the way to `path` as needing a new tree
+  void invalidate(const std::string &path);
+  CacheTree &cache_tree() { return cache_; }
+  const CacheTree &cache_tree() const { return cache_; }
+
+  const std::vector<IndexEntry> &entries() const { return entries_; }
+  std::vector<IndexEntry>::const_iterator begin() const {
+    return entries_.begin();
+  }
+  std::vector<IndexEntry>::const_iterator end() const {
+    return entries_.end();
+  }
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+
+private:
+  std::vector<IndexEntry> entries_;
+  CacheTree cache_;
 };
 
 int cmd_add(int argc, char *argv[]);
 
-void stage_path(const std::filesystem::path &target,
-                const std::filesystem::path &root,
-                std::vector<IndexEntry> &entries);
+// A file selected for staging: its location on disk and repo-relative path
+struct StageTarget {
+  std::filesystem::path file;
+  std::string path;
+};
+
+// Expands a pathspec into the regular files below it (never enters .verz/)
+void collect_paths(const std::filesystem::path &target,
+                   const std::filesystem::path &root,
+                   std::vector<StageTarget> &out);
+
+// Hashes and writes blobs for `targets` in parallel and upserts their
+// entries into `index`; files whose stat data matches the index are skipped
+void stage_paths(const std::vector<StageTarget> &targets, Index &index);
+
+Index read_index();
+void write_index(const Index &index);
+
+// Index matching the tree `tree` as checked out in the working directory,
+// with stat data from the files and a fully valid cached tree
+Index index_from_tree(const ObjectId &tree);
 
-std::vector<IndexEntry> read_index();
-void write_index(const std::vector<IndexEntry> &entries);
+// Captures `path`'s stat data into `entry`; false if it cannot be stat'ed
+bool fill_stat(const std::filesystem::path &path, IndexEntry &entry);
+bool stat_matches(const IndexEntry &entry, const IndexEntry &current);
@@ -13,3 +13,7 @@ int cmd_delete_branch(int argc, char *argv[]);
 std::string current_branch();
 
 std::string branch_ref_path(const std::string &name);
+
+// Tip commit of every branch under .verz/refs/heads and of every
+// remote-tracking branch under .verz/refs/remotes
+std::vector<std::string> list_branch_tips();
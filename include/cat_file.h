@@ -1,4 +1,8 @@
 #pragma once
 #include <string>
 
-int cmd_cat_file(int argc, char* argv[]);
\ No newline at end of file
+int cmd_cat_file(int argc, char* argv[]);
+
+// Serves object names read from stdin until EOF; `withContent` selects
+// --batch over --batch-check
+int cat_file_batch(bool withContent);
@@ -0,0 +1,20 @@
+#pragma once
+#include "object_id.h"
+#include <string>
+#include <vector>
+
+// One file to materialize in the working tree
+struct CheckoutEntry {
+  std::string path; // relative to the current directory
+  ObjectId oid;     // blob
+  std::string mode; // "100644" or "100755"
+};
+
+// Appends every blob reachable from `tree` to `out`, prefixing paths
+// with `prefix`
+void gather_tree(const ObjectId &tree, const std::string &prefix,
+                 std::vector<CheckoutEntry> &out);
+
+// Writes all entries to disk on a worker pool. Parent directories are
+// created first; packed blobs are read in pack offset order.
+void checkout_entries(std::vector<CheckoutEntry> entries);
@@ -1,4 +1,5 @@
 #pragma once
+#include "index_pack.h"
 #include <algorithm>
 #include <array>
 #include <cstddef>
@@ -8,21 +9,61 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <openssl/sha.h>
+#include <set>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <zlib.h>
 
-const int CHUNK = 16384;
+// Largest pkt-line the protocol allows (LARGE_PACKET_MAX)
+const size_t PKT_LINE_MAX = 65520;
 
 enum class Phase { READ_ACK, READ_SIDE_BAND, DONE };
 
+// Fixed-capacity byte ring for reassembling pkt-lines across curl
+// callbacks; consuming from the front never moves the remaining bytes
+class RingBuffer {
+public:
+  explicit RingBuffer(size_t capacity) : data_(capacity) {}
+
+  size_t size() const { return size_; }
+  size_t space() const { return data_.size() - size_; }
+
+  // Copies as much of `src` as fits; returns the number of bytes taken
+  size_t write(const uint8_t *src, size_t len);
+  void copy(size_t offset, size_t len, uint8_t *dst) const;
+  void consume(size_t len);
+
+  // Calls fn(ptr, len) for the (at most two) contiguous pieces of
+  // [offset, offset + len)
+  template <typename Fn> void visit(size_t offset, size_t len, Fn fn) const {
+    size_t start = (head_ + offset) % data_.size();
+    size_t first = std::min(len, data_.size() - start);
+    if (first)
+      fn(data_.data() + start, first);
+    if (len > first)
+      fn(data_.data(), len - first);
+  }
+
+private:
+  std::vector<uint8_t> data_;
+  size_t head_ = 0;
+  size_t size_ = 0;
+};
+
 struct UploadPackParser {
   Phase phase = Phase::READ_ACK;
-  std::vector<uint8_t> buf;
-  std::vector<uint8_t> packfile;
+  RingBuffer buf{2 * PKT_LINE_MAX};
+  PackIndexer *indexer = nullptr; // receives side-band channel 1
+  std::string error;              // set when the write callback aborts
+  std::set<ObjectId> shallow;     // boundary from shallow/unshallow lines
+  bool v2 = false;                // v0 and v2 acknowledge haves differently
+  std::set<ObjectId> common;      // haves the server ACKed
+  bool ready = false;             // server has enough haves to send a pack
 };
 
 struct PktLine {
@@ -30,18 +71,22 @@ struct PktLine {
   std::string data;
 };
 
+struct CloneOptions {
+  // Byte budget for delta bases held while indexing the pack
+  size_t deltaCacheLimit = DELTA_CACHE_LIMIT_DEFAULT;
+  // Commits of history to fetch; 0 = all
+  int depth = 0;
+  // Object filter for a partial clone, e.g. "blob:none"; empty = none
+  std::string filter;
+};
+
 int cmd_clone(int argc, char *argv[]);
 
 size_t writeCallbackPackFileReceive(void *ptr, size_t size, size_t nmemb,
                                     void *userdata);
 
-void clone(std::string &url, std::string root);
-
-std::vector<unsigned char>
-resolveDelta(const std::vector<unsigned char> &base,
-             const std::vector<unsigned char> &delta);
-
-void handlePktLine(UploadPackParser &p, std::string &payload);
+void clone(std::string &url, std::string root,
+           const CloneOptions &options = {});
 
 void parseRecToPktLine(UploadPackParser &p);
 
@@ -56,8 +101,48 @@ readRefs(std::vector<uint8_t> &responseBuffer);
 size_t writeCallbackRefDiscovery(void *ptr, size_t size, size_t nmemb,
                                  void *userdata);
 
-UploadPackParser makeRequest(CURL *curl, const std::string &request,
-                             std::string url);
+// POSTs an upload-pack request and streams the returned pack into
+// `indexer`; `shallow` is updated from the server's shallow lines
+void makeRequest(CURL *curl, const std::string &request, std::string url,
+                 PackIndexer &indexer, std::set<ObjectId> &shallow,
+                 bool v2 = false);
+
+// Same, leaving ACKs, shallow lines and the pack to `response`; used for
+// negotiation rounds, whose response may or may not carry a pack
+void makeRequest(CURL *curl, const std::string &request, std::string url,
+                 UploadPackParser &response);
+
+struct curl_slist *uploadPackHeaders(bool v2);
+
+// One upload-pack fetch request. Over stateless HTTP every negotiation
+// round is a request of its own, repeating the wants and the common haves.
+struct FetchRequest {
+  std::vector<std::string> wants;
+  std::vector<ObjectId> haves;
+  std::set<ObjectId> shallow; // our own shallow commits
+  int depth = 0;
+  std::string filter;
+  bool thin = false; // the pack may delta against objects we have
+  bool done = true;  // false: a negotiation round, the pack may not follow
+  // v0 ACK mode when haves are sent: multi_ack_detailed, multi_ack, or
+  // empty for a single ACK of the first common have
+  std::string ack = "multi_ack_detailed";
+};
+
+// Builds an upload-pack fetch body for protocol v0 or v2
+std::string makeFetchRequest(bool v2, const FetchRequest &fetch);
+std::string makeFetchRequest(bool v2, const std::vector<std::string> &wants,
+                             int depth, const std::string &filter);
+
+std::unordered_map<std::string, std::string>
+lsRefs(CURL *curl, std::string url,
+       const std::vector<std::string> &prefixes = {"HEAD"});
+
+bool isProtocolV2(std::vector<uint8_t> &responseBuffer);
+
+std::string readCapabilities(std::vector<uint8_t> &responseBuffer);
+
+bool hasCapability(const std::string &caps, const std::string &name);
 
 std::string resolveHead(std::unordered_map<std::string, std::string> &refs);
 
@@ -69,18 +154,4 @@ uint32_t read_be32(uint8_t *b);
 
 std::string makePktLine(const std::string &payload);
 
-void parsePackFile(UploadPackParser &p, const std::string &commitSha,
-                   const std::string &root);
-
-std::vector<unsigned char>
-
-decompress_continuous(std::vector<uint8_t> &packfile, uint32_t &consumedBytes,
-                      size_t start, uint32_t &expectedUncompressedSize);
-
-std::vector<unsigned char>
-compress_data(std::vector<unsigned char> &fullContent);
-
-void parseTree(
-    std::string &treeSha, std::string pathPrefix,
-    std::unordered_map<std::string, size_t> &hashCache,
-    std::unordered_map<size_t, std::vector<unsigned char>> &objectCache);
+void checkoutHead(const std::string &commitSha);
@@ -0,0 +1,36 @@
+#pragma once
+#include "object_id.h"
+#include <cstdint>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Per-commit data needed for history walks, without the message text
+struct CommitInfo {
+  ObjectId sha;
+  ObjectId tree;
+  std::vector<ObjectId> parents; // in commit order
+  uint64_t commitTime = 0;
+  uint32_t generation = 0; // 1 for roots, 1 + max(parents) otherwise
+};
+
+std::string commitGraphPath();
+
+// Fills `info` from .verz/objects/info/commit-graph, falling back to
+// parsing the commit object when the graph does not cover `id`. The hex
+// overload reports a malformed name as not a commit.
+bool read_commit_info(const ObjectId &id, CommitInfo &info);
+bool read_commit_info(const std::string &sha, CommitInfo &info);
+
+// Commits listed in .verz/shallow, whose parents were not fetched.
+// read_commit_info reports them as parentless.
+std::string shallowPath();
+const std::unordered_set<ObjectId> &shallow_commits();
+// Replaces .verz/shallow; an empty set removes it
+void write_shallow(const std::set<ObjectId> &commits);
+
+// Rewrites the commit-graph to cover every commit reachable from `tips`.
+// Commits already in the old graph are copied without touching the object
+// store. Returns false (leaving no graph) if history is incomplete.
+bool write_commit_graph(const std::vector<std::string> &tips);
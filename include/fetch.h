@@ -0,0 +1,10 @@
+#pragma once
+#include <string>
+
+int cmd_fetch(int argc, char *argv[]);
+
+// Updates .verz/refs/remotes/<remote>/* from the remote's branches. Over
+// HTTP, local history is offered as "have" lines, so only the objects we
+// lack are sent, as a thin pack. A local remote's new object files are
+// hardlinked instead.
+void fetch(const std::string &remoteName);
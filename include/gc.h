@@ -0,0 +1,8 @@
+#pragma once
+#include <string>
+
+int cmd_gc(int argc, char *argv[]);
+
+// Packs every object reachable from refs/heads (and the index) into one
+// delta-compressed pack, then prunes the loose objects and packs it replaced.
+void gc(int window, int depth, int threads);
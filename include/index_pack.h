@@ -0,0 +1,89 @@
+#pragma once
+#include "object_id.h"
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <openssl/evp.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Default byte budget for resolved delta bases (core.deltaBaseCacheLimit)
+const size_t DELTA_CACHE_LIMIT_DEFAULT = 96 * 1024 * 1024;
+
+// Incremental index-pack: consumes a pack stream as it arrives, spooling it
+// to .verz/objects/pack and hashing undeltified objects on the fly. Deltas
+// are resolved from the on-disk pack once the stream is complete, one
+// base-to-children tree per pool task, so the pack is never held in memory.
+// Resolved bases wait for their children in a cache capped at
+// `deltaCacheLimit` bytes; evicted ones are rebuilt from the pack. Thin
+// packs are completed with the local objects their REF_DELTAs name.
+class PackIndexer {
+public:
+  explicit PackIndexer(size_t deltaCacheLimit = DELTA_CACHE_LIMIT_DEFAULT);
+  ~PackIndexer();
+
+  PackIndexer(const PackIndexer &) = delete;
+  PackIndexer &operator=(const PackIndexer &) = delete;
+
+  void feed(const uint8_t *data, size_t len);
+
+  // Verifies the stream ended cleanly, resolves deltas and installs
+  // pack-<checksum>.{pack,idx}; returns the checksum in hex
+  std::string finish();
+
+  uint32_t objectCount() const { return count_; }
+
+private:
+  enum class State { Header, EntryHeader, OfsBase, RefBase, Data, Trailer, Done };
+
+  struct Entry {
+    uint64_t offset = 0;     // entry header
+    uint64_t dataPos = 0;    // zlib stream
+    uint64_t size = 0;       // inflated size (delta size for deltas)
+    uint8_t type = 0;        // pack type code
+    uint8_t objectType = 0;  // resolved object type
+    uint64_t baseOffset = 0; // OFS_DELTA
+    ObjectId baseSha;        // REF_DELTA
+    ObjectId sha;            // null until known
+    uint32_t crc = 0;
+  };
+
+  void consume(const uint8_t *data, size_t len);
+  void begin_data();
+  size_t inflate_some(const uint8_t *data, size_t len);
+  void end_entry();
+  struct DeltaContext;
+  std::vector<unsigned char> inflate_entry(const DeltaContext &ctx,
+                                           const Entry &e) const;
+  bool has_children(const DeltaContext &ctx, size_t i) const;
+  bool has_unresolved_children(const DeltaContext &ctx, size_t i) const;
+  std::shared_ptr<const std::vector<unsigned char>>
+  base_data(DeltaContext &ctx, size_t i);
+  void resolve_children(DeltaContext &ctx, size_t base);
+  void resolve_deltas(const uint8_t *pack, size_t packSize);
+  void resolve_spooled_pack();
+  std::vector<ObjectId> missing_bases() const;
+  void append_bases(const std::vector<ObjectId> &shas);
+
+  size_t deltaCacheLimit_;
+  std::string tmpPath_;
+  std::ofstream out_;
+  EVP_MD_CTX *packHash_ = nullptr;
+  EVP_MD_CTX *objectHash_ = nullptr;
+  z_stream zs_{};
+  bool finished_ = false;
+
+  State state_ = State::Header;
+  std::string scratch_; // header, base name or trailer bytes seen so far
+  uint64_t offset_ = 0; // pack offset of the next byte
+  uint32_t count_ = 0;
+  uint32_t crc_ = 0;
+  int headerBytes_ = 0;
+  int shift_ = 0;
+  uint64_t ofs_ = 0;
+  Entry cur_;
+  std::vector<Entry> entries_;
+  std::vector<unsigned char> inflateBuf_;
+  std::string checksum_; // 20 raw bytes
+};
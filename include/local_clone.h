@@ -0,0 +1,25 @@
+#pragma once
+#include <map>
+#include <string>
+
+// Repositories on the same filesystem are cloned and fetched without the
+// network: object files are hardlinked (copied where links are not
+// possible) and refs are read straight from the source.
+
+// True for "file://<path>", absolute and ./ or ../ paths, and any other
+// path naming an existing directory
+bool is_local_url(const std::string &url);
+
+// Absolute path to the .verz directory of the repository at `url`; throws
+// if there is none
+std::string local_repo_dir(const std::string &url);
+
+// Links every object file and pack of `srcDir` that `dstDir` lacks.
+// Returns the number of files brought over.
+size_t link_objects(const std::string &srcDir, const std::string &dstDir);
+
+// Branch name -> tip sha under refs/heads of the .verz directory `dir`
+std::map<std::string, std::string> local_branches(const std::string &dir);
+
+// Branch HEAD of the .verz directory `dir` points to
+std::string local_head_branch(const std::string &dir);
@@ -0,0 +1,98 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+
+// A SHA-1 object name held as its 20 raw bytes. Internal tables (tree and
+// index entries, pack entries, commit info, visited sets) and the object
+// store key on this instead of the 40-char hex form: it is half the size,
+// needs no heap allocation, and compares and hashes as plain memory. Hex is
+// produced only at the edges: output, ref files, commit text and the wire.
+struct ObjectId {
+  static constexpr size_t RAW_SIZE = 20;
+  static constexpr size_t HEX_SIZE = 40;
+
+  std::array<uint8_t, RAW_SIZE> bytes{}; // all zero = no object
+
+  // From 20 raw bytes, as stored in trees, indexes and packs
+  static ObjectId from_raw(const void *raw) {
+    ObjectId id;
+    std::memcpy(id.bytes.data(), raw, RAW_SIZE);
+    return id;
+  }
+
+  // Parses 40 hex digits (either case); false on anything else
+  static constexpr bool parse_hex(std::string_view hex, ObjectId &out) {
+    if (hex.size() != HEX_SIZE)
+      return false;
+    for (size_t i = 0; i < RAW_SIZE; i++) {
+      int hi = nibble(hex[2 * i]);
+      int lo = nibble(hex[2 * i + 1]);
+      if (hi < 0 || lo < 0)
+        return false;
+      out.bytes[i] = static_cast<uint8_t>((hi << 4) | lo);
+    }
+    return true;
+  }
+
+  // Parses a name known to be valid; throws std::invalid_argument otherwise.
+  // Uses the vectorized decoder in utils.cpp.
+  static ObjectId from_hex(std::string_view hex);
+
+  // Writes the 40 lowercase hex digits to `out` (no terminator)
+  constexpr void to_hex(char *out) const {
+    constexpr char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < RAW_SIZE; i++) {
+      out[2 * i] = digits[bytes[i] >> 4];
+      out[2 * i + 1] = digits[bytes[i] & 0xF];
+    }
+  }
+
+  // Same digits as to_hex, through the vectorized encoder in utils.cpp
+  std::string hex() const;
+
+  // The 20 raw bytes, for appending to tree or index content
+  std::string_view raw() const {
+    return {reinterpret_cast<const char *>(bytes.data()), RAW_SIZE};
+  }
+
+  constexpr bool is_null() const {
+    for (uint8_t b : bytes)
+      if (b)
+        return false;
+    return true;
+  }
+
+  bool operator==(const ObjectId &o) const {
+    return std::memcmp(bytes.data(), o.bytes.data(), RAW_SIZE) == 0;
+  }
+  bool operator!=(const ObjectId &o) const { return !(*this == o); }
+  // Byte order, which is also the order of the hex names and of pack indexes
+  bool operator<(const ObjectId &o) const {
+    return std::memcmp(bytes.data(), o.bytes.data(), RAW_SIZE) < 0;
+  }
+
+private:
+  static constexpr int nibble(char c) {
+    return c >= '0' && c <= '9'   ? c - '0'
+           : c >= 'a' && c <= 'f' ? c - 'a' + 10
+           : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                  : -1;
+  }
+};
+
+// SHA-1 output is uniformly distributed, so its first 8 bytes are already
+// a good hash
+namespace std {
+template <> struct hash<ObjectId> {
+  size_t operator()(const ObjectId &id) const {
+    uint64_t h;
+    std::memcpy(&h, id.bytes.data(), sizeof(h));
+    return static_cast<size_t>(h);
+  }
+};
+} // namespace std
@@ -0,0 +1,48 @@
+#pragma once
+#include "object_id.h"
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <openssl/evp.h>
+#include <string>
+#include <zlib.h>
+
+// Builds one loose object from content supplied in chunks. Each chunk is
+// hashed and deflated in the same pass, so the "type size\0" header and the
+// content are never concatenated. Compressed bytes stay in memory until they
+// outgrow a small buffer and only then spill to a temporary file. finish()
+// drops them without touching the object store if the object already
+// exists, loose or packed.
+class ObjectWriter {
+public:
+  // `size` is the content length the header declares; `write = false`
+  // only hashes
+  ObjectWriter(const std::string &type, uint64_t size, bool write = true);
+  ~ObjectWriter();
+
+  ObjectWriter(const ObjectWriter &) = delete;
+  ObjectWriter &operator=(const ObjectWriter &) = delete;
+
+  void update(const void *data, size_t len);
+  void update(const std::string &data) { update(data.data(), data.size()); }
+
+  // Returns the object name. Throws if fewer or more bytes than the
+  // declared size were supplied.
+  ObjectId finish_id();
+  // Same, as the 40-char hex SHA1
+  std::string finish() { return finish_id().hex(); }
+
+private:
+  void compress(const void *data, size_t len, int flush);
+  void spill();
+
+  EVP_MD_CTX *hash_ = nullptr;
+  z_stream zs_{};
+  bool write_;
+  bool finished_ = false;
+  uint64_t size_;
+  uint64_t received_ = 0;
+  std::string pending_; // compressed bytes not yet on disk
+  std::string tmpPath_; // set once compressed output spills to disk
+  std::ofstream tmp_;
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include "object_id.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Pack object type codes (3-bit field of the pack entry header)
+enum PackObjectType : uint8_t {
+  PACK_COMMIT = 1,
+  PACK_TREE = 2,
+  PACK_BLOB = 3,
+  PACK_TAG = 4,
+  PACK_OFS_DELTA = 6,
+  PACK_REF_DELTA = 7,
+};
+
+// One row of a version 2 pack index (.idx)
+struct PackIndexEntry {
+  ObjectId sha;      // object name
+  uint32_t crc32;    // CRC32 of the raw (still compressed) pack entry
+  uint64_t offset;   // byte offset of the entry header in the .pack
+};
+
+std::string packTypeName(uint8_t type);
+uint8_t packTypeCode(const std::string &name);
+
+std::vector<unsigned char>
+resolveDelta(const std::vector<unsigned char> &base,
+             const std::vector<unsigned char> &delta);
+
+// Encodes `target` as a delta against `base`; returns "" if the delta would
+// not fit in `maxSize` bytes.
+std::string createDelta(const std::string &base, const std::string &target,
+                        size_t maxSize);
+
+// Inflates one pack entry's zlib stream starting at `data` into exactly
+// `size` bytes; false if the stream is corrupt or has a different length
+bool inflatePackData(const uint8_t *data, size_t avail, uint64_t size,
+                     std::vector<unsigned char> &out);
+
+// Pack store layout: .verz/objects/pack/pack-<checksum>.{pack,idx}
+std::string packDirectory();
+// A fresh .verz/objects/pack/tmp_<kind>_<pid>_<n> name, unique across
+// threads and processes, for a file written before being renamed into place
+std::string packTempPath(const std::string &kind);
+void writePackIndex(const std::string &idxPath,
+                    std::vector<PackIndexEntry> entries,
+                    const std::string &packChecksum);
+
+// Packed object lookup, same contract as readGitObject. The hex overloads
+// parse the name and report anything malformed as missing.
+bool packedObjectExists(const ObjectId &id);
+bool packedObjectExists(const std::string &hash);
+bool readPackedObject(const ObjectId &id, std::string &object);
+bool readPackedObject(const std::string &hash, std::string &object);
+// Type code and inflated size from entry headers alone; a delta's size is
+// read from the first bytes of its delta stream
+bool packedObjectInfo(const ObjectId &id, uint8_t &type, uint64_t &size);
+bool packedObjectInfo(const std::string &hash, uint8_t &type,
+                      uint64_t &size);
+
+// Where a packed object lives, for callers that want to read many objects
+// in on-disk order
+bool packedObjectOffset(const ObjectId &id, std::string &packPath,
+                        uint64_t &offset);
+bool packedObjectOffset(const std::string &hash, std::string &packPath,
+                        uint64_t &offset);
@@ -0,0 +1,17 @@
+#pragma once
+#include "object_id.h"
+#include <string>
+#include <vector>
+
+// Objects left out by a filtered clone are fetched on first use from the
+// promisor remote recorded in .verz/config.
+
+// True if .verz/config names a promisor remote
+bool has_promisor_remote();
+
+// Fetches whichever of `ids` are missing locally, all in one request.
+// Returns false if there is no promisor remote; throws if the fetch fails.
+bool fetch_promised_objects(const std::vector<ObjectId> &ids);
+
+// Marks pack-<name>.pack as received from a promisor remote
+void mark_promisor_pack(const std::string &packName);
@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+
+// A [remote "<name>"] section of .verz/config, in Git's config syntax
+struct Remote {
+  std::string name = "origin";
+  std::string url;
+  bool promisor = false;          // may be asked for objects we lack
+  std::string partialCloneFilter; // e.g. "blob:none"
+};
+
+std::string configPath();
+
+// Fills `remote` from the section named `name`; false if there is none
+bool read_remote(const std::string &name, Remote &remote);
+
+// Replaces the section for `remote.name`, keeping the rest of the file
+void write_remote(const Remote &remote);
@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool: each worker owns a deque, runs its own newest task
+// first and steals the oldest task from a sibling when it runs dry. Tasks
+// submitted from inside a task go to the submitting worker's deque, so
+// recursive work stays local until someone else is idle.
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t threads = 0); // 0 = hardware concurrency
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  void submit(std::function<void()> task);
+
+  // Runs tasks on the calling thread until everything submitted so far has
+  // finished, then rethrows the first exception a task threw (if any).
+  // Only threads outside the pool may wait: a task waiting on its own pool
+  // would wait for itself, so that throws std::logic_error. Tasks that
+  // spawn work signal completion themselves (see write_tree's TreeBuild).
+  void wait();
+
+  size_t size() const { return threads_.size(); }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  bool try_run(size_t self);
+  void worker_loop(size_t self);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> unfinished_{0};
+  std::atomic<size_t> next_queue_{0};
+  std::exception_ptr error_;
+  bool stop_ = false;
+};
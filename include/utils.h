@@ -1,23 +1,62 @@
 #pragma once
+#include "object_id.h"
+#include <cstddef>
+#include <cstdint>
+#include <istream>
 #include <string>
+#include <zlib.h>
 
 // Conversion utilities
+// Writes 2 * n lowercase hex digits for the n bytes at `in`
+void hexEncode(const uint8_t *in, size_t n, char *out);
+// Reads 2 * n hex digits (either case) into n bytes; false if any
+// character is not a hex digit
+bool hexDecode(const char *in, size_t n, uint8_t *out);
 std::string binaryToHex(const std::string &binary);
+// Throws std::invalid_argument on an odd length or a non-hex character
 std::string hexToBinary(const std::string &hex);
 
 // Compression utilities
 std::string zlibCompress(const std::string &data);
 std::string zlibDecompress(const std::string &compressed);
+// The calling thread's inflate context, reset for a new stream. Readers
+// share it instead of paying for inflateInit/inflateEnd on every object.
+z_stream &reusableInflater();
 
 // Hash utilities
 std::string calcSHA1(const std::string &content);
 
-// Git object path utilities
+// Git object path utilities. Internal callers that already hold an
+// ObjectId use those overloads; the hex ones parse the name first and treat
+// a malformed one as missing.
 std::string getObjectPath(const std::string &hash);
+std::string getObjectPath(const ObjectId &id);
+bool objectExists(const ObjectId &id);
 bool objectExists(const std::string &hash);
+std::string readGitObject(const ObjectId &id);
 std::string readGitObject(const std::string &hash);
-void writeGitObject(const std::string &content, const std::string &hash);
+// Type and content size without inflating the content: a loose object
+// inflates only its "type size\0" header, a packed one is answered from
+// its pack entry headers. Same lookup order (and lazy fetch) as
+// readGitObject; false if the object does not exist.
+bool readObjectInfo(const ObjectId &id, std::string &type, uint64_t &size);
+bool readObjectInfo(const std::string &hash, std::string &type,
+                    uint64_t &size);
+// Hashes (and with `write`, stores) one object through ObjectWriter. The
+// *Id variants return the name as an ObjectId, for callers that keep it in
+// their own tables; the others return hex.
+ObjectId createGitObjectId(const std::string &type, const std::string &content,
+                           bool write = false);
 std::string createGitObject(const std::string &type, const std::string &content,
                             bool write = false);
 std::string createBlobObject(const std::string &content, bool write = false);
+// Streams exactly `size` bytes of `in` (or the whole file at `path`) into a
+// blob, reading in fixed-size chunks
+ObjectId createBlobIdFromStream(std::istream &in, uint64_t size,
+                                bool write = false);
+std::string createBlobFromStream(std::istream &in, uint64_t size,
+                                 bool write = false);
+ObjectId createBlobIdFromFile(const std::string &path, bool write = false);
+std::string createBlobFromFile(const std::string &path, bool write = false);
+ObjectId createTreeId(const std::string &entries, bool write = false);
 std::string createTreeObject(const std::string &entries, bool write = false);
@@ -1,4 +1,5 @@
 #pragma once
+#include "object_id.h"
 #include <algorithm>
 #include <filesystem>
 #include <iostream>
@@ -7,10 +8,17 @@
 
 struct TreeEntry {
   std::string mode;
-  std::string sha_hex;
+  ObjectId oid;
   std::string name;
 
   bool operator<(const TreeEntry &other) const { return name < other.name; }
 };
+class Index;
+
 int cmd_write_tree();
+// Throws if a file or directory under `path` cannot be read
 std::string write_tree(std::filesystem::path path);
+
+// Tree of the staged entries; directories whose cached tree is still valid
+// are not rebuilt, and the cache is refreshed for the ones that are
+std::string write_tree_from_index(Index &index);
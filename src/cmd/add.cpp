@@ -1,51 +1,429 @@
 #include "../../include/add.h"
+#include "../../include/thread_pool.h"
 #include "../../include/utils.h"
 #include <algorithm>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <openssl/sha.h>
 #include <sstream>
 #include <string>
+#include <sys/stat.h>
+#include <thread>
 #include <vector>
 
 // ---------------------------------------------------------------------------
 // Index persistence
 // ---------------------------------------------------------------------------
+//
+// Git-compatible "DIRC" version 2 index:
+//   "DIRC" | version | entry count
+//   per entry: ctime, mtime (sec + nsec), dev, ino, mode, uid, gid, size,
+//              20-byte sha, 16-bit flags (name length), path, NUL padding
+//              to a multiple of 8 bytes
+//   extensions: "TREE" (cached tree) only
+//   SHA1 of everything above
 
-std::vector<IndexEntry> read_index() {
-  std::vector<IndexEntry> entries;
-  std::ifstream f(".verz/index");
-  if (!f)
-    return entries; // empty index is fine
+static const size_t INDEX_ENTRY_FIXED = 62;
+
+static uint32_t get_be32(const unsigned char *b) {
+  return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) |
+         (uint32_t(b[2]) << 8) | (uint32_t(b[3]));
+}
 
+static void put_be32(std::string &out, uint32_t v) {
+  out.push_back(static_cast<char>(v >> 24));
+  out.push_back(static_cast<char>(v >> 16));
+  out.push_back(static_cast<char>(v >> 8));
+  out.push_back(static_cast<char>(v));
+}
+
+// Pre-binary indexes were "<mode> <sha> <path>" lines
+static std::vector<IndexEntry> read_text_index(const std::string &data) {
+  std::vector<IndexEntry> entries;
+  std::istringstream f(data);
   std::string line;
   while (std::getline(f, line)) {
     if (line.empty())
       continue;
     std::istringstream ss(line);
     IndexEntry e;
-    ss >> e.mode >> e.sha_hex >> e.path;
-    if (!e.path.empty())
+    std::string hex;
+    ss >> e.mode >> hex >> e.path;
+    if (!e.path.empty() && ObjectId::parse_hex(hex, e.oid))
       entries.push_back(e);
   }
   return entries;
 }
 
-void write_index(const std::vector<IndexEntry> &entries) {
-  std::ofstream f(".verz/index", std::ios::trunc);
+// "TREE" extension, one record per directory in pre-order:
+//   name NUL | entry count (ASCII, -1 if invalid) SP | subtree count LF |
+//   20-byte tree sha (valid records only)
+static void write_cache_tree(std::string &out, const std::string &name,
+                             const CacheTree &node) {
+  out += name;
+  out.push_back('\0');
+  out += std::to_string(node.entryCount) + " " +
+         std::to_string(node.children.size()) + "\n";
+  if (node.entryCount >= 0)
+    out += node.oid.raw();
+  for (const auto &[childName, child] : node.children)
+    write_cache_tree(out, childName, child);
+}
+
+static bool read_cache_tree(const std::string &data, size_t &pos, size_t end,
+                            std::string &name, CacheTree &node) {
+  size_t nul = data.find('\0', pos);
+  if (nul == std::string::npos || nul >= end)
+    return false;
+  name = data.substr(pos, nul - pos);
+  size_t eol = data.find('\n', nul);
+  if (eol == std::string::npos || eol >= end)
+    return false;
+
+  int subtrees = 0;
+  if (std::sscanf(data.c_str() + nul + 1, "%d %d", &node.entryCount,
+                  &subtrees) != 2 ||
+      subtrees < 0)
+    return false;
+  pos = eol + 1;
+  if (node.entryCount >= 0) {
+    if (pos + 20 > end)
+      return false;
+    node.oid = ObjectId::from_raw(data.data() + pos);
+    pos += 20;
+  }
+  for (int i = 0; i < subtrees; i++) {
+    std::string childName;
+    CacheTree child;
+    if (!read_cache_tree(data, pos, end, childName, child))
+      return false;
+    node.children[childName] = std::move(child);
+  }
+  return true;
+}
+
+Index read_index() {
+  std::vector<IndexEntry> entries;
+  std::ifstream f(".verz/index", std::ios::binary);
+  if (!f)
+    return Index(); // empty index is fine
+
+  std::string data((std::istreambuf_iterator<char>(f)),
+                   std::istreambuf_iterator<char>());
+  if (data.compare(0, 4, "DIRC") != 0)
+    return Index(read_text_index(data));
+
+  const unsigned char *d = reinterpret_cast<const unsigned char *>(data.data());
+  if (data.size() < 12 + 20)
+    throw std::runtime_error("index file corrupt");
+  unsigned char checksum[20];
+  SHA1(d, data.size() - 20, checksum);
+  if (std::memcmp(checksum, d + data.size() - 20, 20) != 0)
+    throw std::runtime_error("index file corrupt (bad checksum)");
+  if (get_be32(d + 4) != 2)
+    throw std::runtime_error("unsupported index version");
+
+  uint32_t count = get_be32(d + 8);
+  entries.reserve(count);
+  size_t pos = 12;
+  size_t end = data.size() - 20;
+  for (uint32_t i = 0; i < count; i++) {
+    if (pos + INDEX_ENTRY_FIXED > end)
+      throw std::runtime_error("index file corrupt");
+    const unsigned char *p = d + pos;
+    IndexEntry e;
+    e.ctime_sec = get_be32(p);
+    e.ctime_nsec = get_be32(p + 4);
+    e.mtime_sec = get_be32(p + 8);
+    e.mtime_nsec = get_be32(p + 12);
+    e.dev = get_be32(p + 16);
+    e.ino = get_be32(p + 20);
+    char modeBuf[8];
+    std::snprintf(modeBuf, sizeof(modeBuf), "%o", get_be32(p + 24));
+    e.mode = modeBuf;
+    e.uid = get_be32(p + 28);
+    e.gid = get_be32(p + 32);
+    e.size = get_be32(p + 36);
+    e.oid = ObjectId::from_raw(p + 40);
+
+    size_t nameStart = pos + INDEX_ENTRY_FIXED;
+    size_t nameEnd = data.find('\0', nameStart);
+    if (nameEnd == std::string::npos || nameEnd > end)
+      throw std::runtime_error("index file corrupt");
+    e.path = data.substr(nameStart, nameEnd - nameStart);
+    pos += (INDEX_ENTRY_FIXED + e.path.size() + 8) & ~size_t(7);
+    entries.push_back(std::move(e));
+  }
+
+  // Extensions: only the cached tree is understood, the rest are dropped
+  CacheTree cache;
+  while (pos + 8 <= end) {
+    std::string sig = data.substr(pos, 4);
+    size_t extEnd = pos + 8 + get_be32(d + pos + 4);
+    if (extEnd > end)
+      throw std::runtime_error("index file corrupt");
+    if (sig == "TREE") {
+      size_t extPos = pos + 8;
+      std::string rootName;
+      if (!read_cache_tree(data, extPos, extEnd, rootName, cache))
+        cache = CacheTree{};
+    }
+    pos = extEnd;
+  }
+
+  // Racy entries: a file modified within the same timestamp tick as the
+  // index write would still look clean, so force a re-hash for anything
+  // not strictly older than the index itself
+  IndexEntry indexStat;
+  if (fill_stat(".verz/index", indexStat)) {
+    for (auto &e : entries) {
+      if (e.mtime_sec > indexStat.mtime_sec ||
+          (e.mtime_sec == indexStat.mtime_sec &&
+           e.mtime_nsec >= indexStat.mtime_nsec)) {
+        e.mtime_sec = e.mtime_nsec = 0;
+      }
+    }
+  }
+  Index index(std::move(entries));
+  index.cache_tree() = std::move(cache);
+  return index;
+}
+
+void write_index(const Index &index) {
+  std::string out = "DIRC";
+  put_be32(out, 2);
+  put_be32(out, static_cast<uint32_t>(index.size()));
+
+  for (const auto &e : index) {
+    size_t start = out.size();
+    put_be32(out, e.ctime_sec);
+    put_be32(out, e.ctime_nsec);
+    put_be32(out, e.mtime_sec);
+    put_be32(out, e.mtime_nsec);
+    put_be32(out, e.dev);
+    put_be32(out, e.ino);
+    put_be32(out, static_cast<uint32_t>(std::stoul(e.mode, nullptr, 8)));
+    put_be32(out, e.uid);
+    put_be32(out, e.gid);
+    put_be32(out, e.size);
+    out += e.oid.raw();
+    uint16_t flags = static_cast<uint16_t>(std::min<size_t>(e.path.size(), 0xFFF));
+    out.push_back(static_cast<char>(flags >> 8));
+    out.push_back(static_cast<char>(flags));
+    out += e.path;
+    size_t padded = (INDEX_ENTRY_FIXED + e.path.size() + 8) & ~size_t(7);
+    out.append(padded - (out.size() - start), '\0');
+  }
+
+  const CacheTree &cache = index.cache_tree();
+  if (cache.entryCount >= 0 || !cache.children.empty()) {
+    std::string ext;
+    write_cache_tree(ext, "", cache);
+    out += "TREE";
+    put_be32(out, static_cast<uint32_t>(ext.size()));
+    out += ext;
+  }
+
+  unsigned char checksum[20];
+  SHA1(reinterpret_cast<const unsigned char *>(out.data()), out.size(),
+       checksum);
+  out.append(reinterpret_cast<const char *>(checksum), 20);
+
+  std::ofstream f(".verz/index.lock", std::ios::binary | std::ios::trunc);
   if (!f) {
     std::cerr << "error: could not write .verz/index\n";
     return;
   }
-  for (const auto &e : entries)
-    f << e.mode << " " << e.sha_hex << " " << e.path << "\n";
+  f.write(out.data(), out.size());
+  f.close();
+  std::filesystem::rename(".verz/index.lock", ".verz/index");
+}
+
+bool fill_stat(const std::filesystem::path &path, IndexEntry &entry) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+#ifdef __APPLE__
+  entry.ctime_sec = static_cast<uint32_t>(st.st_ctimespec.tv_sec);
+  entry.ctime_nsec = static_cast<uint32_t>(st.st_ctimespec.tv_nsec);
+  entry.mtime_sec = static_cast<uint32_t>(st.st_mtimespec.tv_sec);
+  entry.mtime_nsec = static_cast<uint32_t>(st.st_mtimespec.tv_nsec);
+#else
+  entry.ctime_sec = static_cast<uint32_t>(st.st_ctim.tv_sec);
+  entry.ctime_nsec = static_cast<uint32_t>(st.st_ctim.tv_nsec);
+  entry.mtime_sec = static_cast<uint32_t>(st.st_mtim.tv_sec);
+  entry.mtime_nsec = static_cast<uint32_t>(st.st_mtim.tv_nsec);
+#endif
+  entry.dev = static_cast<uint32_t>(st.st_dev);
+  entry.ino = static_cast<uint32_t>(st.st_ino);
+  entry.uid = static_cast<uint32_t>(st.st_uid);
+  entry.gid = static_cast<uint32_t>(st.st_gid);
+  entry.size = static_cast<uint32_t>(st.st_size);
+  entry.mode = (st.st_mode & S_IXUSR) ? "100755" : "100644";
+  return true;
+}
+
+bool stat_matches(const IndexEntry &entry, const IndexEntry &current) {
+  return entry.mtime_sec != 0 && entry.mtime_sec == current.mtime_sec &&
+         entry.mtime_nsec == current.mtime_nsec &&
+         entry.ctime_sec == current.ctime_sec &&
+         entry.ctime_nsec == current.ctime_nsec &&
+         entry.ino == current.ino && entry.dev == current.dev &&
+         entry.size == current.size && entry.mode == current.mode;
+}
+
+// Appends the blobs of `tree` (under `prefix`) to `entries` and records
+// the tree in `node`; returns the number of entries added
+static int read_tree_entries(const ObjectId &tree, const std::string &prefix,
+                             std::vector<IndexEntry> &entries,
+                             CacheTree &node) {
+  std::string raw = readGitObject(tree);
+  size_t pos = raw.find('\0');
+  if (pos == std::string::npos)
+    throw std::runtime_error("Malformed tree object: " + tree.hex());
+  pos++;
+
+  int count = 0;
+  while (pos < raw.size()) {
+    size_t space = raw.find(' ', pos);
+    size_t nul = raw.find('\0', space);
+    if (space == std::string::npos || nul == std::string::npos ||
+        nul + 21 > raw.size())
+      throw std::runtime_error("Malformed tree object: " + tree.hex());
+    std::string mode = raw.substr(pos, space - pos);
+    std::string name = raw.substr(space + 1, nul - space - 1);
+    ObjectId sha = ObjectId::from_raw(raw.data() + nul + 1);
+    pos = nul + 21;
+
+    if (mode == "40000" || mode == "040000") {
+      count += read_tree_entries(sha, prefix + name + "/", entries,
+                                 node.children[name]);
+    } else if (mode != "160000") {
+      IndexEntry e;
+      fill_stat(prefix + name, e);
+      e.mode = mode;
+      e.oid = sha;
+      e.path = prefix + name;
+      entries.push_back(std::move(e));
+      count++;
+    }
+  }
+  node.entryCount = count;
+  node.oid = tree;
+  return count;
+}
+
+Index index_from_tree(const ObjectId &tree) {
+  std::vector<IndexEntry> entries;
+  CacheTree cache;
+  read_tree_entries(tree, "", entries, cache);
+  Index index(std::move(entries));
+  index.cache_tree() = std::move(cache);
+  return index;
+}
+
+// ---------------------------------------------------------------------------
+// Sorted index container
+// ---------------------------------------------------------------------------
+
+static bool path_less(const IndexEntry &a, const IndexEntry &b) {
+  return a.path < b.path;
+}
+
+Index::Index(std::vector<IndexEntry> entries) : entries_(std::move(entries)) {
+  // Binary indexes are already sorted; legacy text ones may not be
+  if (!std::is_sorted(entries_.begin(), entries_.end(), path_less))
+    std::stable_sort(entries_.begin(), entries_.end(), path_less);
+}
+
+const IndexEntry *Index::find(const std::string &path) const {
+  auto it = std::lower_bound(
+      entries_.begin(), entries_.end(), path,
+      [](const IndexEntry &e, const std::string &p) { return e.path < p; });
+  if (it == entries_.end() || it->path != path)
+    return nullptr;
+  return &*it;
+}
+
+void Index::update(std::vector<IndexEntry> batch) {
+  if (batch.empty())
+    return;
+  std::stable_sort(batch.begin(), batch.end(), path_less);
+
+  std::vector<IndexEntry> merged;
+  merged.reserve(entries_.size() + batch.size());
+  size_t i = 0;
+  for (size_t j = 0; j < batch.size(); j++) {
+    // Several updates to one path: only the last is kept
+    if (j + 1 < batch.size() && batch[j + 1].path == batch[j].path)
+      continue;
+    while (i < entries_.size() && entries_[i].path < batch[j].path)
+      merged.push_back(std::move(entries_[i++]));
+    bool changed = true;
+    if (i < entries_.size() && entries_[i].path == batch[j].path) {
+      // A re-hash that found the same blob (e.g. after a touch) only
+      // refreshes stat data; the cached trees stay valid
+      changed = entries_[i].oid != batch[j].oid ||
+                entries_[i].mode != batch[j].mode;
+      i++;
+    }
+    if (changed)
+      invalidate(batch[j].path);
+    merged.push_back(std::move(batch[j]));
+  }
+  while (i < entries_.size())
+    merged.push_back(std::move(entries_[i++]));
+  entries_ = std::move(merged);
+}
+
+void Index::remove(std::vector<std::string> paths) {
+  if (paths.empty())
+    return;
+  std::sort(paths.begin(), paths.end());
+
+  std::vector<IndexEntry> kept;
+  kept.reserve(entries_.size());
+  size_t j = 0;
+  for (auto &e : entries_) {
+    while (j < paths.size() && paths[j] < e.path)
+      j++;
+    if (j < paths.size() && paths[j] == e.path) {
+      invalidate(e.path);
+      continue;
+    }
+    kept.push_back(std::move(e));
+  }
+  entries_ = std::move(kept);
+}
+
+void Index::invalidate(const std::string &path) {
+  CacheTree *node = &cache_;
+  node->entryCount = -1;
+  size_t start = 0;
+  size_t slash;
+  while ((slash = path.find('/', start)) != std::string::npos) {
+    auto it = node->children.find(path.substr(start, slash - start));
+    if (it == node->children.end())
+      return;
+    node = &it->second;
+    node->entryCount = -1;
+    start = slash + 1;
+  }
 }
 
 // ---------------------------------------------------------------------------
 // Staging helpers
 // ---------------------------------------------------------------------------
 
+static bool is_repo_dir(const std::filesystem::path &p) {
+  const std::string name = p.filename().string();
+  return name == ".verz" || name == ".git";
+}
+
 static bool should_skip(const std::filesystem::path &p) {
   for (const auto &part : p) {
     const std::string s = part.string();
@@ -55,18 +433,28 @@ static bool should_skip(const std::filesystem::path &p) {
   return false;
 }
 
-void stage_path(const std::filesystem::path &target,
-                const std::filesystem::path &root,
-                std::vector<IndexEntry> &entries) {
-  if (should_skip(target))
+void collect_paths(const std::filesystem::path &target,
+                   const std::filesystem::path &root,
+                   std::vector<StageTarget> &out) {
+  if (should_skip(std::filesystem::relative(target, root)))
     return;
 
+  // One real relative() per pathspec; everything below it is lexical
+  std::filesystem::path base = std::filesystem::relative(target, root);
+
   if (std::filesystem::is_directory(target)) {
-    for (const auto &de :
-         std::filesystem::recursive_directory_iterator(target)) {
-      if (de.is_regular_file() && !should_skip(de.path())) {
-        stage_path(de.path(), root, entries);
+    std::filesystem::recursive_directory_iterator it(target), end;
+    for (; it != end; ++it) {
+      if (it->is_directory() && is_repo_dir(it->path())) {
+        it.disable_recursion_pending();
+        continue;
       }
+      if (!it->is_regular_file())
+        continue;
+      std::filesystem::path rel = it->path().lexically_relative(target);
+      if (base != ".")
+        rel = base / rel;
+      out.push_back({it->path(), rel.string()});
     }
     return;
   }
@@ -76,36 +464,96 @@ void stage_path(const std::filesystem::path &target,
               << "' is not a regular file, skipping\n";
     return;
   }
+  out.push_back({target, base.string()});
+}
+
+void stage_paths(const std::vector<StageTarget> &targets, Index &index) {
+  // Stat pass: only files whose cached stat data is stale go any further
+  struct Pending {
+    std::filesystem::path file;
+    IndexEntry entry;
+    std::string error;
+  };
+  std::vector<Pending> pending;
+  for (const auto &t : targets) {
+    IndexEntry current;
+    if (!fill_stat(t.file, current)) {
+      std::cerr << "error: cannot stat '" << t.file.string() << "'\n";
+      continue;
+    }
+    current.path = t.path;
 
-  // Read file content and hash it
-  std::ifstream file(target, std::ios::binary);
-  if (!file) {
-    std::cerr << "error: cannot open '" << target.string() << "'\n";
+    // Unchanged since it was last hashed: keep the recorded blob
+    const IndexEntry *existing = index.find(t.path);
+    if (existing && stat_matches(*existing, current))
+      continue;
+    pending.push_back({t.file, std::move(current), ""});
+  }
+  if (pending.empty())
     return;
+
+  // Read, hash, deflate and write each blob on the pool; every task owns
+  // exactly one slot of `pending`, so no locking is needed
+  ThreadPool pool(std::min<size_t>(pending.size(),
+                                   std::thread::hardware_concurrency()));
+  for (auto &p : pending) {
+    pool.submit([&p] {
+      try {
+        p.entry.oid = createBlobIdFromFile(p.file.string(), /*write=*/true);
+      } catch (const std::exception &e) {
+        p.error = e.what();
+      }
+    });
   }
-  std::string content((std::istreambuf_iterator<char>(file)),
-                      std::istreambuf_iterator<char>());
-  std::string sha = createBlobObject(content, /*write=*/true);
+  pool.wait();
 
-  // Determine mode
-  std::filesystem::perms perms = std::filesystem::status(target).permissions();
-  bool is_exec = (perms & std::filesystem::perms::owner_exec) !=
-                 std::filesystem::perms::none;
-  std::string mode = is_exec ? "100755" : "100644";
+  // One sorted merge for the whole batch; the result does not depend on
+  // the order tasks finished in
+  std::vector<IndexEntry> updates;
+  updates.reserve(pending.size());
+  for (auto &p : pending) {
+    if (!p.error.empty()) {
+      std::cerr << "error: " << p.error << "\n";
+      continue;
+    }
+    updates.push_back(std::move(p.entry));
+  }
+  index.update(std::move(updates));
+}
 
-  // Repo-relative path
-  std::string relPath = std::filesystem::relative(target, root).string();
+// True if `path` is `scope` itself or lies below it ("" covers everything)
+static bool in_scope(const std::string &path, const std::string &scope) {
+  return path.compare(0, scope.size(), scope) == 0 &&
+         (scope.empty() || path.size() == scope.size() ||
+          path[scope.size()] == '/');
+}
 
-  // Update existing entry or append new one
-  auto it =
-      std::find_if(entries.begin(), entries.end(),
-                   [&](const IndexEntry &e) { return e.path == relPath; });
-  if (it != entries.end()) {
-    it->sha_hex = sha;
-    it->mode = mode;
-  } else {
-    entries.push_back({mode, sha, relPath});
+// Tracked paths covered by `scopes` that no longer exist as files, so that
+// "add <dir>" also stages deletions. `targets` must be sorted by path.
+static std::vector<std::string>
+deleted_paths(const Index &index, const std::vector<std::string> &scopes,
+              const std::vector<StageTarget> &targets) {
+  std::vector<std::string> gone;
+  const auto &entries = index.entries();
+  for (const auto &scope : scopes) {
+    // Everything under `scope` shares it as a prefix, so it is one range
+    auto it = std::lower_bound(
+        entries.begin(), entries.end(), scope,
+        [](const IndexEntry &e, const std::string &p) { return e.path < p; });
+    for (; it != entries.end() && it->path.compare(0, scope.size(), scope) == 0;
+         ++it) {
+      if (!in_scope(it->path, scope))
+        continue;
+      bool present = std::binary_search(
+          targets.begin(), targets.end(), StageTarget{"", it->path},
+          [](const StageTarget &a, const StageTarget &b) {
+            return a.path < b.path;
+          });
+      if (!present)
+        gone.push_back(it->path);
+    }
   }
+  return gone;
 }
 
 // ---------------------------------------------------------------------------
@@ -124,8 +572,16 @@ int cmd_add(int argc, char *argv[]) {
   }
 
   std::filesystem::path root = std::filesystem::current_path();
-  std::vector<IndexEntry> entries = read_index();
+  Index index;
+  try {
+    index = read_index();
+  } catch (const std::exception &e) {
+    std::cerr << "fatal: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
 
+  std::vector<StageTarget> targets;
+  std::vector<std::string> scopes; // pathspecs that can stage deletions
   for (int i = 2; i < argc; i++) {
     std::string arg = argv[i];
     std::filesystem::path target;
@@ -138,19 +594,50 @@ int cmd_add(int argc, char *argv[]) {
         target = root / target;
     }
 
+    std::string scope = std::filesystem::relative(target, root).string();
+    if (scope == ".")
+      scope.clear();
+
     if (!std::filesystem::exists(target)) {
-      std::cerr << "fatal: pathspec '" << arg << "' did not match any files\n";
-      return EXIT_FAILURE;
+      // A deleted file or directory that is still tracked
+      const auto &entries = index.entries();
+      bool tracked = std::any_of(entries.begin(), entries.end(),
+                                 [&](const IndexEntry &e) {
+                                   return in_scope(e.path, scope);
+                                 });
+      if (!tracked) {
+        std::cerr << "fatal: pathspec '" << arg
+                  << "' did not match any files\n";
+        return EXIT_FAILURE;
+      }
+      scopes.push_back(scope);
+      continue;
     }
 
-    stage_path(target, root, entries);
+    if (std::filesystem::is_directory(target))
+      scopes.push_back(scope);
+    collect_paths(target, root, targets);
   }
 
-  // Sort by path for determinism
-  std::sort(
-      entries.begin(), entries.end(),
-      [](const IndexEntry &a, const IndexEntry &b) { return a.path < b.path; });
+  // Overlapping pathspecs ("add . src") must not stage a file twice
+  std::sort(targets.begin(), targets.end(),
+            [](const StageTarget &a, const StageTarget &b) {
+              return a.path < b.path;
+            });
+  targets.erase(std::unique(targets.begin(), targets.end(),
+                            [](const StageTarget &a, const StageTarget &b) {
+                              return a.path == b.path;
+                            }),
+                targets.end());
+
+  try {
+    index.remove(deleted_paths(index, scopes, targets));
+    stage_paths(targets, index);
+  } catch (const std::exception &e) {
+    std::cerr << "fatal: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
 
-  write_index(entries);
+  write_index(index);
   return EXIT_SUCCESS;
 }
@@ -1,6 +1,11 @@
 #include "../../include/branch.h"
+#include "../../include/add.h"
+#include "../../include/checkout.h"
 #include "../../include/commit.h"
+#include "../../include/commit_graph.h"
 #include "../../include/utils.h"
+#include <map>
+#include <set>
 
 std::string branch_ref_path(const std::string &name) {
   return ".verz/refs/heads/" + name;
@@ -32,90 +37,226 @@ static std::string read_branch_sha(const std::string &refPath) {
   return sha;
 }
 
-static void checkout_commit(const std::string &commitSha,
-                            const std::filesystem::path &root);
-
-static void checkout_tree(const std::string &treeSha,
-                          const std::filesystem::path &dir) {
-  std::string rawTree = readGitObject(treeSha);
-
-  size_t nullPos = rawTree.find('\0');
-  if (nullPos == std::string::npos)
-    throw std::runtime_error("Malformed tree object: " + treeSha);
-  std::string treeData = rawTree.substr(nullPos + 1);
-
-  std::filesystem::create_directories(dir);
-
-  size_t pos = 0;
-  while (pos < treeData.size()) {
-    // mode (e.g. "100644" or "40000")
-    size_t spacePos = treeData.find(' ', pos);
-    if (spacePos == std::string::npos)
-      break;
-    std::string mode = treeData.substr(pos, spacePos - pos);
-    pos = spacePos + 1;
-
-    // name (null-terminated)
-    size_t nullPos2 = treeData.find('\0', pos);
-    if (nullPos2 == std::string::npos)
-      break;
-    std::string name = treeData.substr(pos, nullPos2 - pos);
-    pos = nullPos2 + 1;
-
-    // 20-byte binary SHA
-    if (pos + 20 > treeData.size())
-      break;
-    std::string binSha = treeData.substr(pos, 20);
-    pos += 20;
-    std::string sha = binaryToHex(binSha);
-
-    std::filesystem::path entryPath = dir / name;
-
-    if (mode == "40000" || mode == "040000") {
-      std::filesystem::create_directories(entryPath);
-      checkout_tree(sha, entryPath);
-    } else {
-      // blob — read raw object, strip header, write file
-      std::string rawBlob = readGitObject(sha);
-      size_t blobNull = rawBlob.find('\0');
-      std::string content = (blobNull != std::string::npos)
-                                ? rawBlob.substr(blobNull + 1)
-                                : rawBlob;
-
-      std::ofstream out(entryPath, std::ios::binary | std::ios::trunc);
-      if (!out)
-        throw std::runtime_error("Cannot write: " + entryPath.string());
-      out.write(content.data(), content.size());
+std::vector<std::string> list_branch_tips() {
+  std::vector<std::string> tips;
+  for (const char *dir : {".verz/refs/heads", ".verz/refs/remotes"}) {
+    std::filesystem::path refs = dir;
+    if (!std::filesystem::exists(refs))
+      continue;
+    for (const auto &de : std::filesystem::recursive_directory_iterator(refs)) {
+      if (!de.is_regular_file())
+        continue;
+      std::string sha = read_branch_sha(de.path().string());
+      if (sha.size() >= 40)
+        tips.push_back(sha.substr(0, 40));
     }
   }
+  return tips;
+}
+
+// ---------------------------------------------------------------------------
+// Incremental checkout
+// ---------------------------------------------------------------------------
+
+struct TreeItem {
+  std::string mode;
+  ObjectId oid;
+};
+
+static bool is_tree_mode(const std::string &mode) {
+  return mode == "40000" || mode == "040000";
 }
 
-static void checkout_commit(const std::string &commitSha,
-                            const std::filesystem::path &root) {
-  if (commitSha.empty())
+// A null `tree` is the empty tree
+static std::map<std::string, TreeItem> read_tree_items(const ObjectId &tree) {
+  std::map<std::string, TreeItem> items;
+  if (tree.is_null())
+    return items;
+
+  std::string rawTree = readGitObject(tree);
+  size_t pos = rawTree.find('\0');
+  if (pos == std::string::npos)
+    throw std::runtime_error("Malformed tree object: " + tree.hex());
+  pos++;
+
+  while (pos < rawTree.size()) {
+    // <mode> SP <name> NUL <20-byte sha>
+    size_t spacePos = rawTree.find(' ', pos);
+    size_t nullPos = rawTree.find('\0', spacePos);
+    if (spacePos == std::string::npos || nullPos == std::string::npos ||
+        nullPos + 21 > rawTree.size())
+      throw std::runtime_error("Malformed tree object: " + tree.hex());
+    TreeItem item;
+    item.mode = rawTree.substr(pos, spacePos - pos);
+    item.oid = ObjectId::from_raw(rawTree.data() + nullPos + 1);
+    items[rawTree.substr(spacePos + 1, nullPos - spacePos - 1)] = item;
+    pos = nullPos + 21;
+  }
+  return items;
+}
+
+// One file that differs between the two trees; a null newId removes it
+struct PathChange {
+  std::string path;
+  ObjectId oldId;
+  ObjectId newId;
+  std::string newMode;
+};
+
+// Collects the blob-level differences between two trees (null = empty
+// tree), never descending into subtrees whose SHAs are equal
+static void diff_trees(const ObjectId &oldTree, const ObjectId &newTree,
+                       const std::string &prefix,
+                       std::vector<PathChange> &changes) {
+  if (oldTree == newTree)
+    return;
+  auto oldItems = read_tree_items(oldTree);
+  auto newItems = read_tree_items(newTree);
+
+  std::set<std::string> names;
+  for (const auto &entry : oldItems)
+    names.insert(entry.first);
+  for (const auto &entry : newItems)
+    names.insert(entry.first);
+
+  for (const auto &name : names) {
+    auto o = oldItems.find(name);
+    auto n = newItems.find(name);
+    const TreeItem *oldItem = o != oldItems.end() ? &o->second : nullptr;
+    const TreeItem *newItem = n != newItems.end() ? &n->second : nullptr;
+    if (oldItem && newItem && oldItem->oid == newItem->oid &&
+        oldItem->mode == newItem->mode)
+      continue;
+
+    // Submodules are not checked out
+    if ((oldItem && oldItem->mode == "160000") ||
+        (newItem && newItem->mode == "160000"))
+      continue;
+
+    bool oldIsTree = oldItem && is_tree_mode(oldItem->mode);
+    bool newIsTree = newItem && is_tree_mode(newItem->mode);
+    if (oldIsTree || newIsTree)
+      diff_trees(oldIsTree ? oldItem->oid : ObjectId(),
+                 newIsTree ? newItem->oid : ObjectId(), prefix + name + "/",
+                 changes);
+
+    bool oldIsBlob = oldItem && !oldIsTree;
+    bool newIsBlob = newItem && !newIsTree;
+    if (oldIsBlob || newIsBlob)
+      changes.push_back({prefix + name, oldIsBlob ? oldItem->oid : ObjectId(),
+                         newIsBlob ? newItem->oid : ObjectId(),
+                         newIsBlob ? newItem->mode : ""});
+  }
+}
+
+// True if replacing or deleting the file would not lose anything: its
+// content (and staged content) is what the old tree or the new tree has
+static bool safe_to_overwrite(const PathChange &change, const Index &index,
+                              const std::set<std::string> &removals) {
+  const IndexEntry *entry = index.find(change.path);
+  if (entry && entry->oid != change.oldId && entry->oid != change.newId)
+    return false; // staged changes
+
+  IndexEntry current;
+  if (!fill_stat(change.path, current))
+    return true; // nothing on disk
+  if (std::filesystem::is_directory(change.path)) {
+    // Replaceable only if the deletions empty it
+    for (const auto &de :
+         std::filesystem::recursive_directory_iterator(change.path))
+      if (!de.is_directory() && !removals.count(de.path().string()))
+        return false;
+    return true;
+  }
+  if (entry && stat_matches(*entry, current))
+    return true;
+
+  ObjectId sha = createBlobIdFromFile(change.path, /*write=*/false);
+  return sha == change.oldId || sha == change.newId;
+}
+
+// Moves the working tree and index from `oldCommit` to `newCommit`, touching
+// only the files that differ. Throws before changing anything if local
+// changes would be overwritten.
+static void checkout_commit(const std::string &oldCommit,
+                            const std::string &newCommit) {
+  if (newCommit.empty())
     return; // nothing to check out on a brand-new branch
 
-  std::string rawCommit = readGitObject(commitSha);
-  // strip header
-  size_t n = rawCommit.find('\0');
-  std::string commitContent =
-      (n != std::string::npos) ? rawCommit.substr(n + 1) : rawCommit;
-
-  // Parse "tree <sha>\n..."
-  if (commitContent.rfind("tree ", 0) != 0)
-    throw std::runtime_error("Cannot parse commit object: " + commitSha);
-  std::string treeSha = commitContent.substr(5, 40);
-
-  // Remove all tracked files/dirs (everything except .verz)
-  for (const auto &entry : std::filesystem::directory_iterator(root)) {
-    std::string name = entry.path().filename().string();
-    if (name == ".verz")
+  // The commit-graph answers this without inflating the commits
+  CommitInfo oldInfo, newInfo;
+  if (!oldCommit.empty() && !read_commit_info(oldCommit, oldInfo))
+    throw std::runtime_error("Cannot parse commit object: " + oldCommit);
+  if (!read_commit_info(newCommit, newInfo))
+    throw std::runtime_error("Cannot parse commit object: " + newCommit);
+
+  std::vector<PathChange> changes;
+  diff_trees(oldCommit.empty() ? ObjectId() : oldInfo.tree, newInfo.tree, "",
+             changes);
+
+  Index index = read_index();
+  std::set<std::string> removals;
+  for (const auto &change : changes)
+    if (change.newId.is_null())
+      removals.insert(change.path);
+  std::vector<std::string> conflicts;
+  for (const auto &change : changes)
+    if (!safe_to_overwrite(change, index, removals))
+      conflicts.push_back(change.path);
+  if (!conflicts.empty()) {
+    std::string msg = "Your local changes to the following files would be "
+                      "overwritten by checkout:";
+    for (const auto &path : conflicts)
+      msg += "\n\t" + path;
+    throw std::runtime_error(msg);
+  }
+
+  // Deletions first, so a file can become a directory and vice versa
+  std::vector<std::string> removed;
+  for (const auto &change : changes) {
+    if (!change.newId.is_null())
       continue;
-    std::filesystem::remove_all(entry.path());
+    std::filesystem::remove(change.path);
+    removed.push_back(change.path);
+    for (std::filesystem::path dir =
+             std::filesystem::path(change.path).parent_path();
+         !dir.empty() && std::filesystem::is_directory(dir) &&
+         std::filesystem::is_empty(dir);
+         dir = dir.parent_path())
+      std::filesystem::remove(dir);
   }
 
-  checkout_tree(treeSha, root);
+  std::vector<CheckoutEntry> writes;
+  for (const auto &change : changes) {
+    if (change.newId.is_null())
+      continue;
+    if (std::filesystem::is_directory(change.path))
+      std::filesystem::remove(change.path); // emptied by the deletions above
+    writes.push_back({change.path, change.newId, change.newMode});
+  }
+  checkout_entries(writes);
+
+  std::vector<IndexEntry> written;
+  for (const auto &w : writes) {
+    IndexEntry e;
+    fill_stat(w.path, e);
+    e.mode = w.mode;
+    e.oid = w.oid;
+    e.path = w.path;
+    written.push_back(std::move(e));
+  }
+
+  // Unchanged paths keep their index entries (and any staged changes); an
+  // index that never tracked the old tree is rebuilt from the new one
+  if (index.empty()) {
+    index = index_from_tree(newInfo.tree);
+  } else {
+    index.remove(std::move(removed));
+    index.update(std::move(written));
+  }
+  write_index(index);
 }
+
 int cmd_branch(int argc, char *argv[]) {
   if (!std::filesystem::exists(".verz")) {
     std::cerr << "fatal: not a verz repository\n";
@@ -199,7 +340,15 @@ int cmd_switch(int argc, char *argv[]) {
     return EXIT_SUCCESS;
   }
 
-  // Update .verz/HEAD
+  // Check out the branch's commit into the working tree, then move HEAD
+  std::string branchSha = read_branch_sha(refPath);
+  try {
+    checkout_commit(get_head_commit(), branchSha);
+  } catch (const std::exception &e) {
+    std::cerr << "error: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
   std::ofstream headFile(".verz/HEAD", std::ios::trunc);
   if (!headFile) {
     std::cerr << "fatal: cannot write .verz/HEAD\n";
@@ -208,15 +357,6 @@ int cmd_switch(int argc, char *argv[]) {
   headFile << "ref: refs/heads/" << name << "\n";
   headFile.close();
 
-  // Check out the branch's commit into the working tree
-  std::string branchSha = read_branch_sha(refPath);
-  try {
-    checkout_commit(branchSha, std::filesystem::current_path());
-  } catch (const std::exception &e) {
-    std::cerr << "error: " << e.what() << "\n";
-    return EXIT_FAILURE;
-  }
-
   std::cout << "Switched to branch '" << name << "'\n";
   return EXIT_SUCCESS;
 }
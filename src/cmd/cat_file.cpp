@@ -1,77 +1,118 @@
 #include "../../include/cat_file.h"
-#include <fstream>
+#include "../../include/utils.h"
 #include <iostream>
-#include <vector>
-#include <zlib.h>
 
-static std::string getGitBlob(const std::string &filepath) {
-  std::ifstream file(filepath, std::ios::binary);
-  if (!file) {
-    std::cerr << "Failed to open file\n";
-    return "";
-  }
-
-  std::vector<char> compressed{std::istreambuf_iterator<char>(file),
-                               std::istreambuf_iterator<char>()};
-
-  z_stream stream{};
-  stream.next_in = reinterpret_cast<Bytef *>(compressed.data());
-  stream.avail_in = compressed.size();
-
-  if (inflateInit(&stream) != Z_OK) {
-    std::cerr << "inflateInit failed\n";
-    return "";
-  }
-
-  std::string decompressed;
-  char buffer[4096];
-
-  while (true) {
-    stream.next_out = reinterpret_cast<Bytef *>(buffer);
-    stream.avail_out = sizeof(buffer);
-
-    int ret = inflate(&stream, Z_NO_FLUSH);
-
-    decompressed.append(buffer, sizeof(buffer) - stream.avail_out);
+// Reads an object through the shared reader and locates the content after
+// its "type size\0" header
+static bool readObject(const std::string &hash, std::string &object,
+                       std::string &type, size_t &bodyPos) {
+  object = readGitObject(hash);
+  size_t space = object.find(' ');
+  size_t nullPos = object.find('\0');
+  if (space == std::string::npos || nullPos == std::string::npos ||
+      space > nullPos)
+    return false;
+  type = object.substr(0, space);
+  bodyPos = nullPos + 1;
+  return true;
+}
 
-    if (ret == Z_STREAM_END)
-      break;
+static bool isObjectName(const std::string &name) {
+  return name.size() == 40 &&
+         name.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
 
-    if (ret != Z_OK) {
-      std::cerr << "inflate failed\n";
-      inflateEnd(&stream);
-      return "";
+// Answers one object name per line of stdin until EOF, like
+// `git cat-file --batch[-check]`:
+//   <sha> <type> <size>\n[<content>\n]    or    <name> missing\n
+// --batch-check only reads object headers.
+int cat_file_batch(bool withContent) {
+  std::ios::sync_with_stdio(false);
+  std::cin.tie(nullptr);
+
+  std::string line, object, type;
+  while (std::getline(std::cin, line)) {
+    std::string name = line.substr(0, line.find_first_of(" \t"));
+    size_t bodyPos = 0;
+    uint64_t size = 0;
+    bool found = false;
+    if (isObjectName(name)) {
+      try {
+        if (withContent) {
+          found = readObject(name, object, type, bodyPos);
+          size = object.size() - bodyPos;
+        } else {
+          found = readObjectInfo(name, type, size);
+        }
+      } catch (const std::exception &) {
+        found = false;
+      }
     }
-  }
 
-  inflateEnd(&stream);
+    if (!found) {
+      std::cout << name << " missing\n";
+    } else {
+      std::cout << name << ' ' << type << ' ' << size << '\n';
+      if (withContent) {
+        std::cout.write(object.data() + bodyPos, size);
+        std::cout << '\n';
+      }
+    }
 
-  size_t nullPos = decompressed.find('\0');
-  if (nullPos == std::string::npos) {
-    std::cerr << "Invalid git object format\n";
-    return "";
+    // Flush only when the next read could block: piped input is answered
+    // in large writes, and an interactive caller still gets each answer
+    // before it sends the next name
+    if (std::cin.rdbuf()->in_avail() <= 0)
+      std::cout.flush();
   }
-
-  return decompressed.substr(nullPos + 1);
+  std::cout.flush();
+  return 0;
 }
 
 int cmd_cat_file(int argc, char *argv[]) {
-  if (argc < 4) {
-    std::cerr << "Usage: cat-file -p <sha>\n";
+  std::string mode = argc > 2 ? argv[2] : "";
+  if (argc == 3 && (mode == "--batch" || mode == "--batch-check"))
+    return cat_file_batch(mode == "--batch");
+  if (argc < 4 || (mode != "-p" && mode != "-t" && mode != "-s")) {
+    std::cerr << "Usage: cat-file (-p | -t | -s) <sha>\n"
+                 "       cat-file (--batch | --batch-check) < <names>\n";
     return 1;
   }
 
   std::string hash = argv[3];
-  std::string filename =
-      ".verz/objects/" + hash.substr(0, 2) + "/" + hash.substr(2);
-
-  std::string content = getGitBlob(filename);
+  if (mode != "-p") {
+    // Type and size come from the object header alone
+    std::string type;
+    uint64_t size;
+    try {
+      if (!isObjectName(hash) || !readObjectInfo(hash, type, size)) {
+        std::cerr << "fatal: Not a valid object name " << hash << "\n";
+        return 1;
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "fatal: " << e.what() << "\n";
+      return 1;
+    }
+    if (mode == "-t")
+      std::cout << type << "\n";
+    else
+      std::cout << size << "\n";
+    return 0;
+  }
 
-  if (content.empty()) {
+  std::string object, type;
+  size_t bodyPos;
+  try {
+    if (!readObject(hash, object, type, bodyPos)) {
+      std::cerr << "Invalid git object format\n";
+      return 1;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << "\n";
     std::cerr << "Failed to read blob\n";
     return 1;
   }
 
-  std::cout << content;
+  std::cout.write(object.data() + bodyPos, object.size() - bodyPos);
   return 0;
 }
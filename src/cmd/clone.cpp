@@ -1,14 +1,66 @@
 #include "../../include/clone.h"
+#include "../../include/add.h"
+#include "../../include/checkout.h"
+#include "../../include/commit_graph.h"
+#include "../../include/index_pack.h"
+#include "../../include/local_clone.h"
+#include "../../include/pack.h"
+#include "../../include/promisor.h"
+#include "../../include/remote.h"
 #include "../../include/utils.h"
 
+// Parses a byte count with an optional k/m/g suffix, as in "512m"
+static size_t parseSize(const std::string &value) {
+  size_t used;
+  unsigned long long n = std::stoull(value, &used);
+  std::string suffix = value.substr(used);
+  if (suffix == "k" || suffix == "K")
+    n <<= 10;
+  else if (suffix == "m" || suffix == "M")
+    n <<= 20;
+  else if (suffix == "g" || suffix == "G")
+    n <<= 30;
+  else if (!suffix.empty())
+    throw std::invalid_argument(value);
+  return static_cast<size_t>(n);
+}
+
 int cmd_clone(int argc, char *argv[]) {
-  if (argc < 4) {
-    std::cerr << "Usage: clone <repo_link> <directory>\n";
+  CloneOptions options;
+  std::vector<std::string> args;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    try {
+      if (arg.rfind("--delta-cache-size=", 0) == 0) {
+        options.deltaCacheLimit = parseSize(arg.substr(19));
+      } else if (arg.rfind("--depth=", 0) == 0) {
+        options.depth = std::stoi(arg.substr(8));
+      } else if (arg == "--depth" && i + 1 < argc) {
+        options.depth = std::stoi(argv[++i]);
+      } else if (arg.rfind("--filter=", 0) == 0 && arg.size() > 9) {
+        options.filter = arg.substr(9);
+      } else if (arg.rfind("--", 0) == 0) {
+        throw std::invalid_argument(arg);
+      } else {
+        args.push_back(arg);
+      }
+    } catch (const std::exception &) {
+      args.clear();
+      break;
+    }
+  }
+  if (args.size() != 2 || options.depth < 0) {
+    std::cerr << "Usage: clone [--depth <n>] [--filter=<spec>] "
+                 "[--delta-cache-size=<n>[k|m|g]] <repo_link> <directory>\n";
+    return EXIT_FAILURE;
+  }
+
+  try {
+    clone(args[0], args[1], options);
+  } catch (const std::exception &e) {
+    std::cerr << "fatal: " << e.what() << "\n";
     return EXIT_FAILURE;
   }
-  std::string repoLink = argv[2];
-  std::string rootName = argv[3];
-  clone(repoLink, rootName);
   return EXIT_SUCCESS;
 }
 
@@ -33,415 +85,16 @@ PktLine readPktLine(std::vector<uint8_t> &responseBuffer, size_t &offset) {
   return {0, payload};
 }
 
-std::vector<unsigned char>
-resolveDelta(const std::vector<unsigned char> &base,
-             const std::vector<unsigned char> &delta) {
-  int deltaOffset = 0;
-  uint64_t sourceSize = 0, targetSize = 0;
-
-  uint8_t b = delta[deltaOffset++];
-  sourceSize = b & 0x7F; // size of the base object that delta expects
-  int shift = 7;
-  while (b & 0x80) {
-    b = delta[deltaOffset++];
-    sourceSize |= (b & 0x7F) << shift;
-    shift += 7;
-  }
-
-  b = delta[deltaOffset++];
-  targetSize = b & 0x7F; // target size of object after resolving delta
-  shift = 7;
-  while (b & 0x80) {
-    b = delta[deltaOffset++];
-    targetSize |= (b & 0x7F) << shift;
-    shift += 7;
-  }
-
-  if (sourceSize != base.size()) {
-    std::cout << "Source size expected: " << sourceSize
-              << ", actual: " << base.size() << "\n";
-    throw std::runtime_error("Base size mismatch");
-  }
-
-  std::vector<unsigned char> result(targetSize);
-  size_t resultOffset = 0;
-
-  while (deltaOffset < delta.size()) {
-    uint8_t opcode = delta[deltaOffset++];
-    if (opcode & 0x80) {
-      uint64_t copyOffset = 0, copySize = 0;
-      if (opcode & 0x01)
-        copyOffset |= delta[deltaOffset++];
-      if (opcode & 0x02)
-        copyOffset |= delta[deltaOffset++] << 8;
-      if (opcode & 0x04)
-        copyOffset |= delta[deltaOffset++] << 16;
-      if (opcode & 0x08)
-        copyOffset |= delta[deltaOffset++] << 24;
-      if (opcode & 0x10)
-        copySize |= delta[deltaOffset++];
-      if (opcode & 0x20)
-        copySize |= delta[deltaOffset++] << 8;
-      if (opcode & 0x40)
-        copySize |= delta[deltaOffset++] << 16;
-      for (size_t i = 0; i < copySize; i++) {
-        result[resultOffset++] = base[copyOffset + i];
-      }
-    } else {
-      uint64_t insertSize = opcode & 0x7F;
-      for (size_t i = 0; i < insertSize; i++) {
-        result[resultOffset++] = delta[deltaOffset++];
-      }
-    }
-  }
-
-  return result;
-}
-
-std::vector<unsigned char>
-compress_data(std::vector<unsigned char> &fullContent) {
-  z_stream blobStream{};
-  if (deflateInit(&blobStream, Z_DEFAULT_COMPRESSION) != Z_OK) {
-    std::cerr << "deflateInit failed\n";
-    return {};
-  }
-  blobStream.avail_in = fullContent.size();
-  blobStream.next_in = fullContent.data();
-
-  std::vector<unsigned char> compressedData;
-  unsigned char outbuf[CHUNK];
-  int ret;
-  do {
-    blobStream.next_out = outbuf;
-    blobStream.avail_out = CHUNK;
-
-    ret = deflate(&blobStream, Z_FINISH);
-
-    compressedData.insert(compressedData.end(), outbuf,
-                          outbuf + (CHUNK - blobStream.avail_out));
-  } while (ret == Z_OK);
-
-  deflateEnd(&blobStream);
+// Writes out the tree of the cloned HEAD and the matching index
+void checkoutHead(const std::string &commitSha) {
+  CommitInfo head;
+  if (!read_commit_info(commitSha, head))
+    throw std::runtime_error("Cannot parse commit object: " + commitSha);
 
-  return compressedData;
-}
-
-std::vector<unsigned char>
-decompress_continuous(std::vector<uint8_t> &packfile, uint32_t &consumedBytes,
-                      size_t start, uint32_t &expectedUncompressedSize) {
-  std::vector<unsigned char> out;
-  z_stream blobStream{};
-
-  blobStream.zalloc = Z_NULL;
-  blobStream.zfree = Z_NULL;
-  blobStream.opaque = Z_NULL;
-  blobStream.avail_in = packfile.size() - start;
-  blobStream.next_in = packfile.data() + start;
-
-  if (inflateInit(&blobStream) != Z_OK) {
-    std::cerr << "inflateInit failed\n";
-    return {};
-  }
-
-  int ret;
-  unsigned char outbuf[CHUNK];
-  do {
-    blobStream.avail_out = CHUNK;
-    blobStream.next_out = outbuf;
-
-    ret = inflate(&blobStream, Z_NO_FLUSH);
-
-    if (ret == Z_STREAM_ERROR || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
-      std::cerr << "inflate failed because of error code: "
-                << (ret == Z_STREAM_ERROR
-                        ? "Stream error"
-                        : (ret == Z_DATA_ERROR ? "Data error" : "Memory error"))
-                << "\n";
-      inflateEnd(&blobStream);
-      return {};
-    }
-
-    size_t produced = CHUNK - blobStream.avail_out;
-    out.insert(out.end(), outbuf, outbuf + produced);
-  } while (ret != Z_STREAM_END);
-
-  consumedBytes = blobStream.total_in;
-
-  inflateEnd(&blobStream);
-
-  return out;
-}
-
-void parsePackFile(UploadPackParser &p, const std::string &commitSha,
-                   const std::string &root) {
-  if (memcmp(p.packfile.data(), "PACK", 4) != 0) {
-    throw std::runtime_error("Invalid packet");
-  }
-
-  uint32_t version = read_be32(p.packfile.data() + 4);
-  uint32_t nObjects = read_be32(p.packfile.data() + 8);
-
-  size_t offset = 12;
-  std::unordered_map<size_t, std::vector<unsigned char>> objectCache;
-  std::unordered_map<std::string, size_t> hashCache;
-  std::unordered_map<size_t, uint8_t> typeCache;
-  std::vector<unsigned char> decompressed;
-
-  for (size_t i = 0; i < nObjects; i++) {
-    uint32_t uncompressedSize = 0, consumedBytes = 0;
-    uint8_t type = 0;
-    size_t objOffset = offset;
-
-    uint8_t firstByte = p.packfile[offset++];
-    type = (firstByte >> 4) & 0x07;
-    uncompressedSize = firstByte & 0x0F; // low 4 bits are size[3:0]
-    int shift = 4;
-    while (firstByte & 0x80) {
-      firstByte = p.packfile[offset++];
-      uncompressedSize |= (uint32_t)(firstByte & 0x7F) << shift;
-      shift += 7;
-    }
-    if (type <= 4) {
-      decompressed = decompress_continuous(p.packfile, consumedBytes, offset,
-                                           uncompressedSize);
-
-      objectCache[objOffset] = decompressed;
-      typeCache[objOffset] = type;
-      std::string header;
-      switch (type) {
-      case 1:
-        header = "commit " + std::to_string(decompressed.size()) + '\0';
-        break;
-      case 2:
-        header = "tree " + std::to_string(decompressed.size()) + '\0';
-        break;
-      case 3:
-        header = "blob " + std::to_string(decompressed.size()) + '\0';
-        break;
-      case 4:
-        header = "tag " + std::to_string(decompressed.size()) + '\0';
-        break;
-      default:
-        throw std::runtime_error("Unknown object type");
-      }
-
-      std::vector<unsigned char> fullContent;
-      fullContent.insert(fullContent.end(), header.begin(), header.end());
-      fullContent.insert(fullContent.end(), decompressed.begin(),
-                         decompressed.end());
-      std::vector<unsigned char> compressedData = compress_data(fullContent);
-      std::array<unsigned char, 20> hash;
-      SHA1(fullContent.data(), fullContent.size(), hash.data());
-      std::string shaHex = binaryToHex(
-          std::string(reinterpret_cast<const char *>(hash.data()), 20));
-      hashCache[shaHex] = objOffset;
-      // Write the object using raw decompressed content with proper type name
-      std::string typeName;
-      switch (type) {
-      case 1:
-        typeName = "commit";
-        break;
-      case 2:
-        typeName = "tree";
-        break;
-      case 3:
-        typeName = "blob";
-        break;
-      case 4:
-        typeName = "tag";
-        break;
-      }
-      std::string objectHash = createGitObject(
-          typeName,
-          std::string(reinterpret_cast<const char *>(decompressed.data()),
-                      decompressed.size()),
-          true);
-      offset += consumedBytes;
-    } else {
-      if (type == 6) {
-        // ofs-delta
-        uint64_t ofs = 0;
-        uint8_t b;
-
-        do {
-          b = p.packfile[offset++];
-          ofs = (ofs << 7) | (b & 0x7F);
-          if (b & 0x80) {
-            ofs++;
-          }
-        } while (b & 0x80);
-
-        size_t baseOffset = objOffset - ofs;
-        typeCache[objOffset] = typeCache[baseOffset];
-        std::string header;
-        decompressed = decompress_continuous(p.packfile, consumedBytes, offset,
-                                             uncompressedSize);
-        std::vector<unsigned char> targetObject =
-            resolveDelta(objectCache[baseOffset], decompressed);
-
-        switch (typeCache[baseOffset]) {
-        case 1:
-          header = "commit " + std::to_string(targetObject.size()) + '\0';
-          break;
-        case 2:
-          header = "tree " + std::to_string(targetObject.size()) + '\0';
-          break;
-        case 3:
-          header = "blob " + std::to_string(targetObject.size()) + '\0';
-          break;
-        case 4:
-          header = "tag " + std::to_string(targetObject.size()) + '\0';
-          break;
-        default:
-          throw std::runtime_error("Unknown object type");
-        }
-        std::vector<unsigned char> fullContent;
-
-        fullContent.insert(fullContent.end(), header.begin(), header.end());
-        objectCache[objOffset] = targetObject;
-        fullContent.insert(fullContent.end(), targetObject.begin(),
-                           targetObject.end());
-
-        std::array<unsigned char, 20> hash;
-        SHA1(fullContent.data(), fullContent.size(), hash.data());
-        std::string shaHex = binaryToHex(
-            std::string(reinterpret_cast<const char *>(hash.data()), 20));
-        std::string baseTypeName;
-        switch (typeCache[baseOffset]) {
-        case 1:
-          baseTypeName = "commit";
-          break;
-        case 2:
-          baseTypeName = "tree";
-          break;
-        case 3:
-          baseTypeName = "blob";
-          break;
-        case 4:
-          baseTypeName = "tag";
-          break;
-        }
-        std::string objectHash = createGitObject(
-            baseTypeName,
-            std::string(reinterpret_cast<const char *>(targetObject.data()),
-                        targetObject.size()),
-            true);
-        hashCache[shaHex] = objOffset;
-        offset += consumedBytes;
-      } else if (type == 7) {
-        // ref-delta
-        std::array<unsigned char, 20> sha;
-        memcpy(sha.data(), p.packfile.data() + offset, 20);
-        offset += 20;
-
-        std::string shaHex = binaryToHex(
-            std::string(reinterpret_cast<const char *>(sha.data()), 20));
-        size_t baseOffset = hashCache[shaHex];
-        typeCache[objOffset] = typeCache[baseOffset];
-
-        decompressed = decompress_continuous(p.packfile, consumedBytes, offset,
-                                             uncompressedSize);
-        std::string header;
-        std::vector<unsigned char> targetObject =
-            resolveDelta(objectCache[baseOffset], decompressed);
-
-        switch (typeCache[baseOffset]) {
-        case 1:
-          header = "commit " + std::to_string(targetObject.size()) + '\0';
-          break;
-        case 2:
-          header = "tree " + std::to_string(targetObject.size()) + '\0';
-          break;
-        case 3:
-          header = "blob " + std::to_string(targetObject.size()) + '\0';
-          break;
-        case 4:
-          header = "tag " + std::to_string(targetObject.size()) + '\0';
-          break;
-        default:
-          throw std::runtime_error("Unknown object type");
-        }
-        std::vector<unsigned char> fullContent;
-        fullContent.insert(fullContent.end(), header.begin(), header.end());
-
-        objectCache[objOffset] = targetObject;
-        fullContent.insert(fullContent.end(), targetObject.begin(),
-                           targetObject.end());
-
-        std::array<unsigned char, 20> hash;
-        SHA1(fullContent.data(), fullContent.size(), hash.data());
-        std::string shaHexTarget = binaryToHex(
-            std::string(reinterpret_cast<const char *>(hash.data()), 20));
-        std::string refBaseTypeName;
-        switch (typeCache[baseOffset]) {
-        case 1:
-          refBaseTypeName = "commit";
-          break;
-        case 2:
-          refBaseTypeName = "tree";
-          break;
-        case 3:
-          refBaseTypeName = "blob";
-          break;
-        case 4:
-          refBaseTypeName = "tag";
-          break;
-        }
-        std::string objectHash = createGitObject(
-            refBaseTypeName,
-            std::string(reinterpret_cast<const char *>(targetObject.data()),
-                        targetObject.size()),
-            true);
-        hashCache[shaHexTarget] = objOffset;
-        offset += consumedBytes;
-      }
-    }
-  }
-  std::vector<unsigned char> commitData = objectCache[hashCache[commitSha]];
-  size_t spacePos =
-      std::find(commitData.begin(), commitData.end(), ' ') - commitData.begin();
-  std::string shaHex = std::string(commitData.begin() + spacePos + 1,
-                                   commitData.begin() + spacePos + 41);
-  parseTree(shaHex, root + "/", hashCache, objectCache);
-}
-
-void parseTree(
-    std::string &treeSha, std::string pathPrefix,
-    std::unordered_map<std::string, size_t> &hashCache,
-    std::unordered_map<size_t, std::vector<unsigned char>> &objectCache) {
-  size_t offset = hashCache[treeSha];
-  std::vector<unsigned char> treeData = objectCache[offset];
-
-  size_t pos = 0;
-  while (pos < treeData.size()) {
-    size_t spacePos = std::find(treeData.begin() + pos, treeData.end(), ' ') -
-                      treeData.begin();
-    std::string mode(treeData.begin() + pos, treeData.begin() + spacePos);
-    pos = spacePos + 1;
-    std::string name(treeData.begin() + pos,
-                     std::find(treeData.begin() + pos, treeData.end(), '\0'));
-    pos += name.size() + 1;
-    std::array<unsigned char, 20> sha;
-    for (auto it = treeData.begin() + pos; it != treeData.begin() + pos + 20;
-         ++it) {
-      sha[it - (treeData.begin() + pos)] = *it;
-    }
-    std::string shaHex = binaryToHex(
-        std::string(reinterpret_cast<const char *>(sha.data()), 20));
-    pos += 20;
-    if (mode == "40000") {
-      std::filesystem::create_directory(pathPrefix + name);
-
-      parseTree(shaHex, pathPrefix + name + "/", hashCache, objectCache);
-    } else {
-      std::vector<unsigned char> blobData = objectCache[hashCache[shaHex]];
-
-      std::ofstream outFile(pathPrefix + name, std::ios::binary);
-      outFile.write(reinterpret_cast<const char *>(blobData.data()),
-                    blobData.size());
-      outFile.close();
-    }
-  }
+  std::vector<CheckoutEntry> files;
+  gather_tree(head.tree, "", files);
+  checkout_entries(std::move(files));
+  write_index(index_from_tree(head.tree));
 }
 
 std::unordered_map<std::string, std::string>
@@ -481,6 +134,170 @@ readRefs(std::vector<uint8_t> &responseBuffer) {
   return refs;
 }
 
+// Offset of the first pkt-line after the "# service=" banner; v2
+// advertisements may leave the banner out
+static size_t skipServiceBanner(std::vector<uint8_t> &responseBuffer) {
+  size_t offset = 0;
+  PktLine first = readPktLine(responseBuffer, offset);
+  if (first.data.rfind("# service=", 0) != 0)
+    return 0;
+  readPktLine(responseBuffer, offset); // flush
+  return offset;
+}
+
+bool isProtocolV2(std::vector<uint8_t> &responseBuffer) {
+  size_t offset = skipServiceBanner(responseBuffer);
+  return offset < responseBuffer.size() &&
+         readPktLine(responseBuffer, offset).data == "version 2\n";
+}
+
+// Space-separated capabilities. In v0 they follow the first ref after a
+// NUL. In v2 each is a line, and the features of "fetch=<features>" are
+// listed as capabilities of their own, so "filter" or "shallow" are
+// looked up the same way in both.
+std::string readCapabilities(std::vector<uint8_t> &responseBuffer) {
+  bool v2 = isProtocolV2(responseBuffer);
+  size_t offset = skipServiceBanner(responseBuffer);
+  PktLine first = readPktLine(responseBuffer, offset);
+  if (!v2) {
+    size_t nullPos = first.data.find('\0');
+    if (nullPos == std::string::npos)
+      return "";
+    std::string caps = first.data.substr(nullPos + 1);
+    return caps.substr(0, caps.find('\n'));
+  }
+
+  std::string caps;
+  while (true) {
+    PktLine pkt = readPktLine(responseBuffer, offset);
+    if (pkt.flush)
+      break;
+    std::string line = pkt.data.substr(0, pkt.data.find('\n'));
+    if (line.rfind("fetch=", 0) == 0)
+      line = "fetch " + line.substr(6);
+    caps += (caps.empty() ? "" : " ") + line;
+  }
+  return caps;
+}
+
+bool hasCapability(const std::string &caps, const std::string &name) {
+  std::istringstream ss(caps);
+  std::string cap;
+  while (ss >> cap)
+    if (cap == name || cap.rfind(name + "=", 0) == 0)
+      return true;
+  return false;
+}
+
+// Protocol v2 ref discovery: asks only for refs under `prefixes` (by
+// default HEAD and its symref target), so the cost does not grow with the
+// number of refs on the server. Returns refs in the same shape as
+// readRefs(): HEAD's oid carries the trailing space that resolveHead()
+// looks for.
+std::unordered_map<std::string, std::string>
+lsRefs(CURL *curl, std::string url, const std::vector<std::string> &prefixes) {
+  std::string request = makePktLine("command=ls-refs\n");
+  request += "0001";
+  request += makePktLine("symrefs\n");
+  for (const auto &prefix : prefixes)
+    request += makePktLine("ref-prefix " + prefix + "\n");
+  request += "0000";
+
+  std::vector<uint8_t> responseBuffer;
+  url += ".git/git-upload-pack";
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.data());
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, request.size());
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallbackRefDiscovery);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseBuffer);
+  curl_easy_setopt(curl, CURLOPT_POST, 1L);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, "mygit/0.1");
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  struct curl_slist *headers = uploadPackHeaders(true);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  CURLcode res = curl_easy_perform(curl);
+  curl_slist_free_all(headers);
+  if (res != CURLE_OK) {
+    throw std::runtime_error("Failed to list refs");
+  }
+  curl_easy_reset(curl);
+
+  // "<oid> <refname>[ symref-target:<target>]"
+  std::unordered_map<std::string, std::string> refs;
+  size_t offset = 0;
+  while (offset < responseBuffer.size()) {
+    PktLine pkt = readPktLine(responseBuffer, offset);
+    if (pkt.flush)
+      break;
+    std::istringstream line(pkt.data);
+    std::string oid, name, attr;
+    line >> oid >> name;
+    if (name != "HEAD") {
+      refs[name] = oid;
+      continue;
+    }
+    refs[name] = oid + " ";
+    while (line >> attr)
+      if (attr.rfind("symref-target:", 0) == 0)
+        refs[attr.substr(14)] = oid;
+  }
+  return refs;
+}
+
+std::string makeFetchRequest(bool v2, const FetchRequest &fetch) {
+  std::string request;
+  if (v2) {
+    // The packfile section is always side-band multiplexed in v2
+    request += makePktLine("command=fetch\n");
+    request += "0001";
+    if (fetch.thin)
+      request += makePktLine("thin-pack\n");
+    request += makePktLine("ofs-delta\n");
+    request += makePktLine("no-progress\n");
+    for (const auto &want : fetch.wants)
+      request += makePktLine("want " + want + "\n");
+  } else {
+    std::string capabilities = "side-band-64k ofs-delta";
+    // Reports every common have, not just the first
+    if ((!fetch.haves.empty() || !fetch.done) && !fetch.ack.empty())
+      capabilities += " " + fetch.ack;
+    if (fetch.thin)
+      capabilities += " thin-pack";
+    if (fetch.depth > 0 || !fetch.shallow.empty())
+      capabilities += " shallow";
+    if (!fetch.filter.empty())
+      capabilities += " filter";
+    for (const auto &want : fetch.wants)
+      request += makePktLine("want " + want +
+                             (request.empty() ? " " + capabilities : "") +
+                             "\n");
+  }
+  for (const auto &id : fetch.shallow)
+    request += makePktLine("shallow " + id.hex() + "\n");
+  if (fetch.depth > 0)
+    request += makePktLine("deepen " + std::to_string(fetch.depth) + "\n");
+  if (!fetch.filter.empty())
+    request += makePktLine("filter " + fetch.filter + "\n");
+  if (!v2)
+    request += "0000"; // v0 ends the wants before the haves
+  for (const auto &have : fetch.haves)
+    request += makePktLine("have " + have.hex() + "\n");
+  if (fetch.done)
+    request += makePktLine("done\n");
+  if (v2 || !fetch.done)
+    request += "0000";
+  return request;
+}
+
+std::string makeFetchRequest(bool v2, const std::vector<std::string> &wants,
+                             int depth, const std::string &filter) {
+  FetchRequest fetch;
+  fetch.wants = wants;
+  fetch.depth = depth;
+  fetch.filter = filter;
+  return makeFetchRequest(v2, fetch);
+}
+
 std::string resolveHead(std::unordered_map<std::string, std::string> &refs) {
   std::string head;
 
@@ -498,28 +315,28 @@ std::string
 initialiseGitRepo(const std::string &root,
                   std::unordered_map<std::string, std::string> &refs) {
   std::filesystem::create_directory(root);
-  std::filesystem::create_directory(root + "/.git");
-  std::filesystem::create_directory(root + "/.git/objects");
-  std::filesystem::create_directory(root + "/.git/refs");
-  std::filesystem::create_directory(root + "/.git/refs/heads");
+  std::filesystem::create_directory(root + "/.verz");
+  std::filesystem::create_directory(root + "/.verz/objects");
+  std::filesystem::create_directory(root + "/.verz/refs");
+  std::filesystem::create_directory(root + "/.verz/refs/heads");
 
-  std::ofstream headFile(root + "/.git/HEAD");
+  std::ofstream headFile(root + "/.verz/HEAD");
   headFile << "ref: refs/heads/master\n";
   headFile.close();
 
   std::string commitSha;
   if (refs.count("refs/heads/master")) {
     commitSha = refs["refs/heads/master"];
-    std::ofstream masterRefFile(root + "/.git/refs/heads/master");
+    std::ofstream masterRefFile(root + "/.verz/refs/heads/master");
     masterRefFile << commitSha << "\n";
     masterRefFile.close();
   } else if (refs.count("refs/heads/main")) {
     commitSha = refs["refs/heads/main"];
-    std::ofstream mainRefFile(root + "/.git/refs/heads/main");
+    std::ofstream mainRefFile(root + "/.verz/refs/heads/main");
     mainRefFile << commitSha << "\n";
     mainRefFile.close();
 
-    std::ofstream headFile(root + "/.git/HEAD");
+    std::ofstream headFile(root + "/.verz/HEAD");
     headFile << "ref: refs/heads/main\n";
     headFile.close();
   } else {
@@ -562,8 +379,13 @@ std::vector<uint8_t> discoverRefs(CURL *curl, std::string url) {
   // curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallbackRefDiscovery);
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseBuffer);
+  // Servers that do not speak v2 ignore the header and answer with v0
+  struct curl_slist *headers =
+      curl_slist_append(nullptr, "Git-Protocol: version=2");
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
   CURLcode res = curl_easy_perform(curl);
+  curl_slist_free_all(headers);
   if (res != CURLE_OK) {
     throw std::runtime_error("Failed to discover refs");
   }
@@ -571,59 +393,103 @@ std::vector<uint8_t> discoverRefs(CURL *curl, std::string url) {
   return responseBuffer;
 }
 
-void handlePktLine(UploadPackParser &p, std::string &payload) {
-  if (p.phase == Phase::READ_ACK) {
-    if (payload.substr(0, 3) == "NAK") {
-      p.phase = Phase::READ_SIDE_BAND;
-      return;
-    }
-    return;
-  }
+size_t RingBuffer::write(const uint8_t *src, size_t len) {
+  size_t n = std::min(len, space());
+  size_t tail = (head_ + size_) % data_.size();
+  size_t first = std::min(n, data_.size() - tail);
+  std::memcpy(data_.data() + tail, src, first);
+  std::memcpy(data_.data(), src + first, n - first);
+  size_ += n;
+  return n;
+}
 
-  if (p.phase == Phase::READ_SIDE_BAND) {
-    char band = payload[0];
-    const char *data = payload.data() + 1;
-    size_t len = payload.size() - 1;
+void RingBuffer::copy(size_t offset, size_t len, uint8_t *dst) const {
+  visit(offset, len, [&dst](const uint8_t *p, size_t n) {
+    std::memcpy(dst, p, n);
+    dst += n;
+  });
+}
 
-    switch (band) {
-    case '\x01':
-      p.packfile.insert(p.packfile.end(), data, data + len);
-      break;
-    case '\x02':
-      break;
-    case '\x03':
-      throw std::runtime_error(std::string("Remote error : ") +
-                               std::string(data, len));
-    }
-  }
+void RingBuffer::consume(size_t len) {
+  head_ = (head_ + len) % data_.size();
+  size_ -= len;
 }
-void parseRecToPktLine(UploadPackParser &p) {
-  size_t offset = 0;
 
-  while (true) {
-    if (p.buf.size() - offset < 4)
-      break;
+// Object name at `pos` in an ACK or shallow line
+static ObjectId response_oid(const std::string &line, size_t pos) {
+  ObjectId id;
+  if (!ObjectId::parse_hex(std::string_view(line).substr(pos, 40), id))
+    throw std::runtime_error("Bad object name from server: " + line);
+  return id;
+}
 
+// Handles every complete pkt-line in the ring. Side-band pack data goes to
+// the indexer straight from the ring, without an intermediate copy.
+void parseRecToPktLine(UploadPackParser &p) {
+  while (p.buf.size() >= 4) {
     char lenbuf[5];
-    memcpy(lenbuf, p.buf.data() + offset, 4);
+    p.buf.copy(0, 4, reinterpret_cast<uint8_t *>(lenbuf));
     lenbuf[4] = '\0';
-    int len = std::strtol(lenbuf, nullptr, 16);
-    if (len == 0) {
-      offset += 4;
-      continue; // flush packet — just skip, don't change phase
+    char *end;
+    size_t len = std::strtoul(lenbuf, &end, 16);
+    if (end != lenbuf + 4 || len == 3 || len > PKT_LINE_MAX)
+      throw std::runtime_error("Bad pkt-line length");
+    if (len < 4) {
+      p.buf.consume(4);
+      continue; // flush, v2 delim or response-end — skip, don't change phase
     }
-
-    if (p.buf.size() - offset < (size_t)len)
+    if (p.buf.size() < len)
       break;
 
-    std::string payload(reinterpret_cast<char *>(p.buf.data() + offset + 4),
-                        len - 4);
-    handlePktLine(p, payload);
-
-    offset += len;
+    size_t payloadLen = len - 4;
+    if (p.phase == Phase::READ_ACK) {
+      std::string line(payloadLen, '\0');
+      p.buf.copy(4, payloadLen, reinterpret_cast<uint8_t *>(&line[0]));
+      if (!line.empty() && line.back() == '\n')
+        line.pop_back();
+      // A deepen request is answered with the new shallow boundary first
+      if (line.rfind("shallow ", 0) == 0)
+        p.shallow.insert(response_oid(line, 8));
+      else if (line.rfind("unshallow ", 0) == 0)
+        p.shallow.erase(response_oid(line, 10));
+      else if (line.rfind("ACK ", 0) == 0) {
+        // v0 multi_ack_detailed: "ACK <oid> common|ready" while
+        // negotiating, a bare "ACK <oid>" just before the pack; multi_ack
+        // says "continue" instead and never "ready". Without either, the
+        // only ACK is a bare one for the first common have. v2 ACKs are
+        // always bare; "ready" comes on a line of its own.
+        std::string status = line.size() > 45 ? line.substr(45) : "";
+        p.common.insert(response_oid(line, 4));
+        if (status == "ready")
+          p.ready = true;
+        if (!p.v2 && status.empty())
+          p.phase = Phase::READ_SIDE_BAND;
+      } else if (line == "ready")
+        p.ready = true;
+      else if (line == "NAK" || line == "packfile") // v0 / v2
+        p.phase = Phase::READ_SIDE_BAND;
+      else if (line.rfind("ERR ", 0) == 0)
+        throw std::runtime_error("Remote error : " + line.substr(4));
+    } else if (p.phase == Phase::READ_SIDE_BAND && payloadLen > 0) {
+      uint8_t band;
+      p.buf.copy(4, 1, &band);
+      switch (band) {
+      case 1:
+        p.buf.visit(5, payloadLen - 1, [&p](const uint8_t *data, size_t n) {
+          p.indexer->feed(data, n);
+        });
+        break;
+      case 2:
+        break; // progress messages
+      case 3: {
+        std::string msg(payloadLen - 1, '\0');
+        p.buf.copy(5, payloadLen - 1, reinterpret_cast<uint8_t *>(&msg[0]));
+        throw std::runtime_error("Remote error : " + msg);
+      }
+      }
+    }
+    p.buf.consume(len);
   }
-
-  p.buf.erase(p.buf.begin(), p.buf.begin() + offset);
 }
 
 size_t writeCallbackPackFileReceive(void *ptr, size_t size, size_t nmemb,
@@ -632,16 +498,49 @@ size_t writeCallbackPackFileReceive(void *ptr, size_t size, size_t nmemb,
   auto *p = static_cast<UploadPackParser *>(userdata);
   auto *data = static_cast<uint8_t *>(ptr);
 
-  p->buf.insert(p->buf.end(), data, data + bytes);
-  parseRecToPktLine(*p);
-
+  // Exceptions must not cross libcurl; returning short aborts the transfer
+  try {
+    size_t done = 0;
+    while (done < bytes) {
+      size_t n = p->buf.write(data + done, bytes - done);
+      done += n;
+      size_t before = p->buf.size();
+      parseRecToPktLine(*p);
+      if (n == 0 && p->buf.size() == before)
+        throw std::runtime_error("pkt-line buffer overflow");
+    }
+  } catch (const std::exception &e) {
+    p->error = e.what();
+    return 0;
+  }
   return bytes;
 }
 
-UploadPackParser makeRequest(CURL *curl, const std::string &request,
-                             std::string url) {
+struct curl_slist *uploadPackHeaders(bool v2) {
+  struct curl_slist *headers = nullptr;
+  headers = curl_slist_append(
+      headers, "Content-Type: application/x-git-upload-pack-request");
+  headers = curl_slist_append(headers,
+                              "Accept: application/x-git-upload-pack-result");
+  headers = curl_slist_append(headers, "Expect: ");
+  if (v2)
+    headers = curl_slist_append(headers, "Git-Protocol: version=2");
+  return headers;
+}
+
+void makeRequest(CURL *curl, const std::string &request, std::string url,
+                 PackIndexer &indexer, std::set<ObjectId> &shallow,
+                 bool v2) {
   UploadPackParser response;
+  response.indexer = &indexer;
+  response.shallow = std::move(shallow);
+  response.v2 = v2;
+  makeRequest(curl, request, url, response);
+  shallow = std::move(response.shallow);
+}
 
+void makeRequest(CURL *curl, const std::string &request, std::string url,
+                 UploadPackParser &response) {
   url += ".git/git-upload-pack";
   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
   // curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
@@ -654,46 +553,124 @@ UploadPackParser makeRequest(CURL *curl, const std::string &request,
   curl_easy_setopt(curl, CURLOPT_USERAGENT, "mygit/0.1");
   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 
-  struct curl_slist *headers = nullptr;
-  headers = curl_slist_append(
-      headers, "Content-Type: application/x-git-upload-pack-request");
-  headers = curl_slist_append(headers,
-                              "Accept: application/x-git-upload-pack-result");
-  headers = curl_slist_append(headers, "Expect: ");
-
+  struct curl_slist *headers = uploadPackHeaders(response.v2);
   curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
   CURLcode res = curl_easy_perform(curl);
+  curl_slist_free_all(headers);
 
+  if (!response.error.empty()) {
+    throw std::runtime_error(response.error);
+  }
   if (res != CURLE_OK) {
     throw std::runtime_error("Failed to make request");
   }
   curl_easy_reset(curl);
+}
 
-  return response;
+// Clones a repository on the same filesystem: its object files and packs
+// are hardlinked rather than packed, sent and indexed again
+static void localClone(const std::string &url, const std::string &root,
+                       const CloneOptions &options) {
+  std::string src = local_repo_dir(url);
+  if (options.depth > 0 || !options.filter.empty())
+    std::cerr << "warning: --depth and --filter are ignored in local "
+                 "clones\n";
+  std::map<std::string, std::string> branches = local_branches(src);
+  std::string head = local_head_branch(src);
+  if (!branches.count(head))
+    throw std::runtime_error("source repository has no commits on " + head);
+
+  std::filesystem::create_directories(root + "/.verz/refs/heads");
+  size_t linked = link_objects(src, root + "/.verz");
+  // Linked objects are only complete up to the source's own boundary
+  if (std::filesystem::exists(src + "/shallow"))
+    std::filesystem::copy_file(src + "/shallow", root + "/.verz/shallow");
+
+  std::ofstream(root + "/.verz/HEAD") << "ref: refs/heads/" << head << "\n";
+  std::ofstream(root + "/.verz/refs/heads/" + head) << branches[head] << "\n";
+  for (const auto &[branch, sha] : branches) {
+    std::string path = root + "/.verz/refs/remotes/origin/" + branch;
+    std::filesystem::create_directories(
+        std::filesystem::path(path).parent_path());
+    std::ofstream(path) << sha << "\n";
+  }
+  std::cout << "Linked " << linked << " object files\n";
+
+  std::string source = std::filesystem::path(src).parent_path().string();
+  if (std::filesystem::path(src).filename() != ".verz")
+    source = src; // cloned from a bare .verz directory
+  std::filesystem::current_path(root);
+  Remote origin;
+  origin.url = source;
+  write_remote(origin);
+  checkoutHead(branches[head]);
 }
 
-void clone(std::string &url, std::string root) {
+void clone(std::string &url, std::string root, const CloneOptions &options) {
+  std::error_code ec;
+  if (std::filesystem::exists(root, ec) && !std::filesystem::is_empty(root, ec))
+    throw std::runtime_error("destination path '" + root +
+                             "' already exists and is not an empty "
+                             "directory");
+  if (is_local_url(url)) {
+    localClone(url, root, options);
+    std::cout << "Cloned repo in " << root << "\n";
+    return;
+  }
+
   curl_global_init(CURL_GLOBAL_DEFAULT);
   CURL *curl = curl_easy_init();
+  std::unique_ptr<CURL, void (*)(CURL *)> guard(curl, [](CURL *c) {
+    curl_easy_cleanup(c);
+    curl_global_cleanup();
+  });
   std::vector<uint8_t> responseBuffer = discoverRefs(curl, url);
+  bool v2 = isProtocolV2(responseBuffer);
+  std::string caps = readCapabilities(responseBuffer);
   std::cout << "Discovered refs:\n";
-  std::unordered_map<std::string, std::string> refs = readRefs(responseBuffer);
+  std::unordered_map<std::string, std::string> refs =
+      v2 ? lsRefs(curl, url) : readRefs(responseBuffer);
   std::string head = resolveHead(refs);
+  if (head.empty())
+    throw std::runtime_error("Remote has no HEAD");
   std::cout << "Resolving head\n";
   std::string oid = refs[head];
   oid.erase(--oid.end());
 
-  std::string request =
-      makePktLine("want " + oid + " side-band-64k ofs-delta\n");
-  request += "0000";
-  request += makePktLine("done\n");
+  std::string filter = options.filter;
+  if (!filter.empty() && !hasCapability(caps, "filter")) {
+    std::cerr << "warning: filtering not recognized by server, ignoring\n";
+    filter.clear();
+  }
+  if (options.depth > 0 && !hasCapability(caps, "shallow"))
+    throw std::runtime_error("Server does not support shallow clients");
 
-  UploadPackParser packfile = makeRequest(curl, request, url);
+  std::string request = makeFetchRequest(v2, {oid}, options.depth, filter);
 
   std::string commitSha = initialiseGitRepo(root, refs);
-  parsePackFile(packfile, commitSha, root);
+  // Object and pack paths are repository-relative from here on
+  std::filesystem::current_path(root);
+
+  // The pack is indexed while it downloads and lands directly in
+  // .verz/objects/pack
+  PackIndexer indexer(options.deltaCacheLimit);
+  std::set<ObjectId> shallow;
+  makeRequest(curl, request, url, indexer, shallow, v2);
+  std::string packName = indexer.finish();
+  // Commits whose parents were left out; log and gc stop there
+  write_shallow(shallow);
+
+  // A filtered clone promises the objects it left out; they are fetched
+  // from origin when first needed, starting with the checkout below
+  Remote origin;
+  origin.url = url;
+  if (!filter.empty()) {
+    origin.promisor = true;
+    origin.partialCloneFilter = filter;
+    mark_promisor_pack(packName);
+  }
+  write_remote(origin);
+  checkoutHead(commitSha);
 
-  curl_easy_cleanup(curl);
-  curl_global_cleanup();
   std::cout << "Cloned repo in " << root << "\n";
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "../../include/commit.h"
 #include "../../include/add.h"
+#include "../../include/commit_graph.h"
 #include "../../include/commit_tree.h"
 #include "../../include/write_tree.h"
 #include <cstdlib>
@@ -84,13 +85,26 @@ int cmd_commit(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
-  std::vector<IndexEntry> index = read_index();
+  Index index;
+  try {
+    index = read_index();
+  } catch (const std::exception &e) {
+    std::cerr << "fatal: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
   if (index.empty()) {
     std::cout << "On branch master\nnothing to commit, working tree clean\n";
     return EXIT_SUCCESS;
   }
 
-  std::string treeHash = write_tree(std::filesystem::current_path());
+  std::string treeHash;
+  try {
+    treeHash = write_tree_from_index(index);
+    write_index(index); // keep the refreshed cached tree
+  } catch (const std::exception &e) {
+    std::cerr << "fatal: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
 
   std::string parentHash;
   try {
@@ -100,17 +114,26 @@ int cmd_commit(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
+  // The index now outlives commits, so an unchanged tree is the signal
+  // that there is nothing new to record
+  CommitInfo parent;
+  if (!parentHash.empty() && read_commit_info(parentHash, parent) &&
+      parent.tree == ObjectId::from_hex(treeHash)) {
+    std::cout << "nothing to commit, working tree clean\n";
+    return EXIT_SUCCESS;
+  }
+
   std::string commitHash = commit_tree(treeHash, parentHash, message);
 
   try {
+    // The commit-graph is left to gc and fetch: rewriting it here would
+    // walk all of history on every commit. Newer commits are parsed.
     update_head(commitHash);
   } catch (const std::exception &e) {
     std::cerr << e.what() << "\n";
     return EXIT_FAILURE;
   }
 
-  write_index({});
-
   std::string branch = "master";
   std::ifstream headFile(".verz/HEAD");
   if (headFile) {
@@ -74,15 +74,7 @@ std::string commit_tree(std::string treeHash, std::string parentHash,
   content += message;
   content += "\n";
 
-  // Build the full object: "commit <size>\0<content>"
-  std::string object = "commit ";
-  object += std::to_string(content.size());
-  object += '\0';
-  object += content;
-
-  std::string hash = calcSHA1(object);
-  writeGitObject(object, hash);
-  return hash;
+  return createGitObject("commit", content, /*write=*/true);
 }
 
 std::string getUserConfig() {
@@ -0,0 +1,263 @@
+#include "../../include/fetch.h"
+#include "../../include/branch.h"
+#include "../../include/clone.h"
+#include "../../include/commit_graph.h"
+#include "../../include/index_pack.h"
+#include "../../include/local_clone.h"
+#include "../../include/promisor.h"
+#include "../../include/remote.h"
+#include "../../include/utils.h"
+#include <map>
+#include <queue>
+#include <unordered_set>
+
+// Haves in the first negotiation round. Later rounds double it, as
+// upstream fetch-pack does over stateless HTTP.
+static const size_t INITIAL_HAVES = 16;
+static const size_t LARGE_HAVES = 16384;
+// Stop negotiating after this many haves in a row found nothing new in
+// common
+static const size_t MAX_IN_VAIN = 256;
+
+int cmd_fetch(int argc, char *argv[]) {
+  if (argc > 3) {
+    std::cerr << "Usage: fetch [<remote>]\n";
+    return EXIT_FAILURE;
+  }
+  try {
+    fetch(argc == 3 ? argv[2] : "origin");
+  } catch (const std::exception &e) {
+    std::cerr << "fatal: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// Negotiation
+// ---------------------------------------------------------------------------
+
+// Local history for "have" lines, newest commit first. A commit the server
+// acknowledged passes that mark on to its parents, which are then skipped
+// rather than offered: the server already knows we have them.
+class HaveWalk {
+public:
+  explicit HaveWalk(const std::vector<std::string> &tips) {
+    ObjectId id;
+    for (const auto &tip : tips)
+      if (ObjectId::parse_hex(tip, id))
+        push(id);
+  }
+
+  // Next commit to offer; a null id once history is exhausted
+  ObjectId next() {
+    while (!queue_.empty()) {
+      Item item = queue_.top();
+      queue_.pop();
+      bool common = common_.count(item.id) > 0;
+      for (const auto &parent : item.parents) {
+        if (common)
+          common_.insert(parent);
+        push(parent);
+      }
+      if (!common)
+        return item.id;
+    }
+    return ObjectId();
+  }
+
+  void mark_common(const ObjectId &id) {
+    common_.insert(id);
+    CommitInfo info;
+    if (read_commit_info(id, info))
+      common_.insert(info.parents.begin(), info.parents.end());
+  }
+
+private:
+  struct Item {
+    uint64_t time;
+    ObjectId id;
+    std::vector<ObjectId> parents;
+    bool operator<(const Item &o) const { return time < o.time; }
+  };
+
+  void push(const ObjectId &id) {
+    if (!seen_.insert(id).second)
+      return;
+    CommitInfo info;
+    if (read_commit_info(id, info))
+      queue_.push({info.commitTime, id, std::move(info.parents)});
+  }
+
+  std::priority_queue<Item> queue_;
+  std::unordered_set<ObjectId> seen_;
+  std::unordered_set<ObjectId> common_;
+};
+
+// Sends have lines in growing batches until the server is ready, history
+// runs out, or MAX_IN_VAIN haves go unacknowledged, then asks for the pack.
+// Returns false if no pack was received.
+static bool negotiate(CURL *curl, const std::string &url, bool v2,
+                      FetchRequest request, PackIndexer &indexer) {
+  HaveWalk walk(list_branch_tips());
+  std::set<ObjectId> common;
+  size_t batch = INITIAL_HAVES;
+  size_t inVain = 0;
+
+  while (!request.done) {
+    // Each round restates what is already known to be common
+    request.haves.assign(common.begin(), common.end());
+    size_t sent = 0;
+    for (ObjectId id; sent < batch && !(id = walk.next()).is_null(); sent++)
+      request.haves.push_back(id);
+    if (sent == 0)
+      break;
+
+    UploadPackParser response;
+    response.indexer = &indexer;
+    response.v2 = v2;
+    makeRequest(curl, makeFetchRequest(v2, request), url, response);
+
+    size_t before = common.size();
+    for (const auto &id : response.common)
+      if (common.insert(id).second)
+        walk.mark_common(id);
+    inVain = common.size() > before ? 0 : inVain + sent;
+
+    // A v2 server that is ready sends the pack in the same response
+    if (response.ready && v2)
+      return true;
+    if (response.ready || (!common.empty() && inVain >= MAX_IN_VAIN))
+      break;
+    // A single-ACK server acknowledges only its first common have, so
+    // further rounds would learn nothing
+    if (!v2 && request.ack.empty() && !common.empty())
+      break;
+    batch = batch < LARGE_HAVES ? batch * 2 : batch * 11 / 10;
+  }
+
+  request.haves.assign(common.begin(), common.end());
+  request.done = true;
+  UploadPackParser response;
+  response.indexer = &indexer;
+  response.v2 = v2;
+  makeRequest(curl, makeFetchRequest(v2, request), url, response);
+  return response.phase == Phase::READ_SIDE_BAND;
+}
+
+// ---------------------------------------------------------------------------
+// Refs
+// ---------------------------------------------------------------------------
+
+static std::string read_ref(const std::string &path) {
+  std::ifstream f(path);
+  std::string sha;
+  std::getline(f, sha);
+  return sha.substr(0, 40);
+}
+
+static void write_ref(const std::string &path, const std::string &sha) {
+  std::filesystem::create_directories(
+      std::filesystem::path(path).parent_path());
+  std::ofstream f(path + ".lock", std::ios::trunc);
+  f << sha << "\n";
+  f.close();
+  if (!f)
+    throw std::runtime_error("Cannot write " + path);
+  std::filesystem::rename(path + ".lock", path);
+}
+
+// ---------------------------------------------------------------------------
+// Fetch
+// ---------------------------------------------------------------------------
+
+// Downloads what `remote` has beyond local history over smart HTTP;
+// returns the remote's branches
+static std::map<std::string, std::string> fetchPack(const Remote &remote) {
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  CURL *curl = curl_easy_init();
+  std::unique_ptr<CURL, void (*)(CURL *)> guard(curl, [](CURL *c) {
+    curl_easy_cleanup(c);
+    curl_global_cleanup();
+  });
+
+  std::vector<uint8_t> advertisement = discoverRefs(curl, remote.url);
+  bool v2 = isProtocolV2(advertisement);
+  std::string caps = readCapabilities(advertisement);
+  std::unordered_map<std::string, std::string> refs =
+      v2 ? lsRefs(curl, remote.url, {"refs/heads/"}) : readRefs(advertisement);
+
+  // refs/heads/<branch> -> remote oid, in name order for the report
+  std::map<std::string, std::string> branches;
+  for (const auto &[name, oid] : refs)
+    if (name.rfind("refs/heads/", 0) == 0)
+      branches[name.substr(11)] = oid.substr(0, 40);
+
+  std::set<std::string> wanted;
+  for (const auto &[branch, oid] : branches)
+    if (!objectExists(oid))
+      wanted.insert(oid);
+
+  if (!wanted.empty()) {
+    FetchRequest request;
+    request.wants.assign(wanted.begin(), wanted.end());
+    request.shallow.insert(shallow_commits().begin(), shallow_commits().end());
+    if (!request.shallow.empty() && !hasCapability(caps, "shallow"))
+      throw std::runtime_error("Server does not support shallow clients");
+    if (remote.promisor && hasCapability(caps, "filter"))
+      request.filter = remote.partialCloneFilter;
+    // v2 servers always accept thin-pack and ACK every common have
+    request.thin = v2 || hasCapability(caps, "thin-pack");
+    // Older v0 servers ACK in less detail, but still find common history
+    if (!v2 && !hasCapability(caps, "multi_ack_detailed"))
+      request.ack = hasCapability(caps, "multi_ack") ? "multi_ack" : "";
+    request.done = false;
+
+    PackIndexer indexer;
+    if (!negotiate(curl, remote.url, v2, request, indexer))
+      throw std::runtime_error("Remote sent no pack");
+    std::string packName = indexer.finish();
+    if (!request.filter.empty())
+      mark_promisor_pack(packName);
+    std::cout << "Received " << indexer.objectCount() << " objects into pack-"
+              << packName << ".pack\n";
+  }
+  return branches;
+}
+
+void fetch(const std::string &remoteName) {
+  if (!std::filesystem::exists(".verz"))
+    throw std::runtime_error("not a verz repository");
+  Remote remote;
+  if (!read_remote(remoteName, remote) || remote.url.empty())
+    throw std::runtime_error("'" + remoteName +
+                             "' does not appear to be a remote");
+
+  std::cout << "From " << remote.url << "\n";
+  std::map<std::string, std::string> branches;
+  if (is_local_url(remote.url)) {
+    // Same filesystem: link whatever object files are new
+    std::string src = local_repo_dir(remote.url);
+    branches = local_branches(src);
+    size_t linked = link_objects(src, ".verz");
+    if (linked)
+      std::cout << "Linked " << linked << " object files\n";
+  } else {
+    branches = fetchPack(remote);
+  }
+
+  for (const auto &[branch, oid] : branches) {
+    std::string path = ".verz/refs/remotes/" + remoteName + "/" + branch;
+    std::string old = read_ref(path);
+    if (old == oid)
+      continue;
+    write_ref(path, oid);
+    std::string to = remoteName + "/" + branch;
+    if (old.empty())
+      std::cout << " * [new branch]      " << branch << " -> " << to << "\n";
+    else
+      std::cout << "   " << old.substr(0, 7) << ".." << oid.substr(0, 7)
+                << "  " << branch << " -> " << to << "\n";
+  }
+  write_commit_graph(list_branch_tips());
+}
@@ -0,0 +1,447 @@
+#include "../../include/gc.h"
+#include "../../include/add.h"
+#include "../../include/branch.h"
+#include "../../include/commit_graph.h"
+#include "../../include/pack.h"
+#include "../../include/promisor.h"
+#include "../../include/thread_pool.h"
+#include "../../include/utils.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <openssl/evp.h>
+#include <thread>
+#include <unordered_set>
+#include <zlib.h>
+
+struct PackObject {
+  ObjectId sha;
+  uint8_t type;
+  uint32_t nameHash = 0;
+  int base = -1;        // index of the delta base, -1 if stored whole
+  int depth = 0;        // delta chain length below this object
+  uint64_t rawSize = 0; // inflated size of `data` (object or delta)
+  std::string data;     // deflated entry payload
+};
+
+// ---------------------------------------------------------------------------
+// Reachability walk
+// ---------------------------------------------------------------------------
+
+// Git's pack name hash: sorts objects with similar trailing path characters
+// next to each other so the delta window sees likely bases.
+static uint32_t name_hash(const std::string &name) {
+  uint32_t hash = 0;
+  for (unsigned char c : name) {
+    if (std::isspace(c))
+      continue;
+    hash = (hash >> 2) + (uint32_t(c) << 24);
+  }
+  return hash;
+}
+
+static std::string object_body(const ObjectId &sha) {
+  std::string raw = readGitObject(sha);
+  size_t nul = raw.find('\0');
+  if (nul == std::string::npos)
+    throw std::runtime_error("Malformed object: " + sha.hex());
+  return raw.substr(nul + 1);
+}
+
+static std::vector<PackObject>
+collect_reachable(const std::vector<std::string> &tips,
+                  const Index &index) {
+  std::vector<PackObject> objects;
+  std::unordered_set<ObjectId> seen;
+
+  auto add = [&](const ObjectId &sha, uint8_t type,
+                 const std::string &name) {
+    if (!seen.insert(sha).second)
+      return false;
+    PackObject obj;
+    obj.sha = sha;
+    obj.type = type;
+    obj.nameHash = name_hash(name);
+    objects.push_back(std::move(obj));
+    return true;
+  };
+
+  std::vector<ObjectId> commits;
+  std::vector<ObjectId> trees;
+  bool promisor = has_promisor_remote();
+  for (const auto &tip : tips) {
+    ObjectId id = ObjectId::from_hex(tip);
+    if (add(id, PACK_COMMIT, ""))
+      commits.push_back(id);
+  }
+
+  while (!commits.empty()) {
+    ObjectId sha = commits.back();
+    commits.pop_back();
+    std::string body = object_body(sha);
+
+    size_t pos = 0;
+    while (pos < body.size() && body[pos] != '\n') {
+      size_t eol = body.find('\n', pos);
+      if (eol == std::string::npos)
+        eol = body.size();
+      if (body.compare(pos, 5, "tree ") == 0) {
+        ObjectId tree = ObjectId::from_hex(body.substr(pos + 5, 40));
+        if (add(tree, PACK_TREE, ""))
+          trees.push_back(tree);
+      } else if (body.compare(pos, 7, "parent ") == 0) {
+        std::string hex = body.substr(pos + 7, 40);
+        ObjectId parent = ObjectId::from_hex(hex);
+        // A missing parent marks a shallow boundary; stop there
+        if (!seen.count(parent) && objectExists(hex) &&
+            add(parent, PACK_COMMIT, ""))
+          commits.push_back(parent);
+      }
+      pos = eol + 1;
+    }
+  }
+
+  while (!trees.empty()) {
+    ObjectId sha = trees.back();
+    trees.pop_back();
+    std::string body = object_body(sha);
+
+    size_t pos = 0;
+    while (pos < body.size()) {
+      size_t space = body.find(' ', pos);
+      size_t nul = body.find('\0', space);
+      if (space == std::string::npos || nul == std::string::npos ||
+          nul + 21 > body.size())
+        throw std::runtime_error("Malformed tree object: " + sha.hex());
+      std::string mode = body.substr(pos, space - pos);
+      std::string name = body.substr(space + 1, nul - space - 1);
+      ObjectId entry = ObjectId::from_raw(body.data() + nul + 1);
+      pos = nul + 21;
+
+      if (mode == "40000" || mode == "040000") {
+        if (add(entry, PACK_TREE, name))
+          trees.push_back(entry);
+      } else if (mode != "160000") { // submodule commits live elsewhere
+        // Blobs a partial clone never fetched stay with the promisor
+        if (!promisor || seen.count(entry) || objectExists(entry))
+          add(entry, PACK_BLOB, name);
+      }
+    }
+  }
+
+  // Staged blobs are not reachable from any ref yet but must survive
+  for (const auto &e : index)
+    if (!seen.count(e.oid) && objectExists(e.oid))
+      add(e.oid, PACK_BLOB,
+          std::filesystem::path(e.path).filename().string());
+
+  return objects;
+}
+
+// ---------------------------------------------------------------------------
+// Delta search
+// ---------------------------------------------------------------------------
+
+static const size_t MIN_DELTA_TARGET = 64;
+
+struct WindowEntry {
+  int index;
+  std::string content;
+};
+
+// Runs a sliding window over order[begin, end): each object is tried as a
+// delta against the previous `window` objects of the same type, keeping the
+// smallest delta whose base is still under the depth limit.
+static void delta_search(std::vector<PackObject> &objects,
+                         const std::vector<int> &order, size_t begin,
+                         size_t end, int window, int depth) {
+  std::deque<WindowEntry> win;
+
+  for (size_t k = begin; k < end; k++) {
+    PackObject &obj = objects[order[k]];
+    std::string content = object_body(obj.sha);
+
+    std::string best;
+    int bestBase = -1;
+    if (content.size() >= MIN_DELTA_TARGET) {
+      size_t maxSize = content.size() / 2 - 20;
+      for (auto it = win.rbegin(); it != win.rend(); ++it) {
+        const PackObject &cand = objects[it->index];
+        if (cand.type != obj.type || cand.depth >= depth)
+          continue;
+        size_t limit = bestBase < 0 ? maxSize : best.size() - 1;
+        std::string delta = createDelta(it->content, content, limit);
+        if (!delta.empty()) {
+          best = std::move(delta);
+          bestBase = it->index;
+        }
+      }
+    }
+
+    if (bestBase >= 0) {
+      obj.base = bestBase;
+      obj.depth = objects[bestBase].depth + 1;
+      obj.rawSize = best.size();
+      obj.data = zlibCompress(best);
+    } else {
+      obj.rawSize = content.size();
+      obj.data = zlibCompress(content);
+    }
+
+    win.push_back({order[k], std::move(content)});
+    if (win.size() > static_cast<size_t>(window))
+      win.pop_front();
+  }
+}
+
+// Cuts `order` into segments for parallel delta search. Cuts fall only
+// where the type or the name hash changes, so the versions of one path (the
+// pairs that delta best) always share a window. There are several segments
+// per worker, so the pool can balance segments of uneven cost.
+static std::vector<std::pair<size_t, size_t>>
+delta_segments(const std::vector<PackObject> &objects,
+               const std::vector<int> &order, size_t target) {
+  std::vector<std::pair<size_t, size_t>> segments;
+  size_t begin = 0;
+  for (size_t k = 1; k < order.size(); k++) {
+    const PackObject &prev = objects[order[k - 1]];
+    const PackObject &cur = objects[order[k]];
+    if (prev.type != cur.type ||
+        (k - begin >= target && prev.nameHash != cur.nameHash)) {
+      segments.push_back({begin, k});
+      begin = k;
+    }
+  }
+  if (begin < order.size())
+    segments.push_back({begin, order.size()});
+  return segments;
+}
+
+// ---------------------------------------------------------------------------
+// Pack writer
+// ---------------------------------------------------------------------------
+
+static std::string encode_entry_header(uint8_t type, uint64_t size) {
+  std::string out;
+  uint8_t c = static_cast<uint8_t>((type << 4) | (size & 0x0F));
+  size >>= 4;
+  while (size) {
+    out.push_back(static_cast<char>(c | 0x80));
+    c = size & 0x7F;
+    size >>= 7;
+  }
+  out.push_back(static_cast<char>(c));
+  return out;
+}
+
+static std::string encode_ofs(uint64_t ofs) {
+  char buf[16];
+  int pos = sizeof(buf) - 1;
+  buf[pos] = static_cast<char>(ofs & 0x7F);
+  while (ofs >>= 7)
+    buf[--pos] = static_cast<char>(0x80 | (--ofs & 0x7F));
+  return std::string(buf + pos, sizeof(buf) - pos);
+}
+
+// Writes the pack (bases always before their deltas) and its index; returns
+// the pack's checksum in hex.
+static std::string write_pack(const std::vector<PackObject> &objects) {
+  std::filesystem::create_directories(packDirectory());
+  // Another gc, or a clone's indexer, may be writing a pack alongside
+  std::string tmpPath = packTempPath("pack");
+  std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+  if (!out)
+    throw std::runtime_error("Cannot write " + tmpPath);
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(ctx, EVP_sha1(), nullptr);
+  uint64_t offset = 0;
+  auto emit = [&](const std::string &bytes) {
+    out.write(bytes.data(), bytes.size());
+    EVP_DigestUpdate(ctx, bytes.data(), bytes.size());
+    offset += bytes.size();
+  };
+
+  std::string header = "PACK";
+  uint32_t fields[2] = {2, static_cast<uint32_t>(objects.size())};
+  for (uint32_t v : fields) {
+    header.push_back(static_cast<char>(v >> 24));
+    header.push_back(static_cast<char>(v >> 16));
+    header.push_back(static_cast<char>(v >> 8));
+    header.push_back(static_cast<char>(v));
+  }
+  emit(header);
+
+  std::vector<uint64_t> offsets(objects.size(), 0);
+  std::vector<bool> written(objects.size(), false);
+  std::vector<PackIndexEntry> index;
+  index.reserve(objects.size());
+
+  std::function<void(int)> write_object = [&](int i) {
+    if (written[i])
+      return;
+    const PackObject &obj = objects[i];
+    if (obj.base >= 0)
+      write_object(obj.base);
+
+    offsets[i] = offset;
+    std::string entry;
+    if (obj.base >= 0) {
+      entry = encode_entry_header(PACK_OFS_DELTA, obj.rawSize);
+      entry += encode_ofs(offset - offsets[obj.base]);
+    } else {
+      entry = encode_entry_header(obj.type, obj.rawSize);
+    }
+    uint32_t crc = crc32(0L, reinterpret_cast<const Bytef *>(entry.data()),
+                         entry.size());
+    crc = crc32(crc, reinterpret_cast<const Bytef *>(obj.data.data()),
+                obj.data.size());
+    emit(entry);
+    emit(obj.data);
+
+    index.push_back({obj.sha, crc, offsets[i]});
+    written[i] = true;
+  };
+  for (size_t i = 0; i < objects.size(); i++)
+    write_object(static_cast<int>(i));
+
+  unsigned char checksum[20];
+  EVP_DigestFinal_ex(ctx, checksum, nullptr);
+  EVP_MD_CTX_free(ctx);
+  out.write(reinterpret_cast<const char *>(checksum), 20);
+  out.close();
+
+  std::string checksumBin(reinterpret_cast<const char *>(checksum), 20);
+  std::string packBase = packDirectory() + "/pack-" + binaryToHex(checksumBin);
+  std::filesystem::rename(tmpPath, packBase + ".pack");
+  writePackIndex(packBase + ".idx", std::move(index), checksumBin);
+  return binaryToHex(checksumBin);
+}
+
+// ---------------------------------------------------------------------------
+// Pruning
+// ---------------------------------------------------------------------------
+
+static size_t prune_packed(const std::vector<PackObject> &objects,
+                           const std::string &keepPack) {
+  size_t removed = 0;
+  for (const auto &obj : objects) {
+    std::filesystem::path loose = getObjectPath(obj.sha);
+    if (std::filesystem::remove(loose)) {
+      removed++;
+      std::error_code ec;
+      std::filesystem::remove(loose.parent_path(), ec); // only if empty
+    }
+  }
+
+  // Every reachable object now lives in the new pack
+  std::string keep = "pack-" + keepPack;
+  for (const auto &de : std::filesystem::directory_iterator(packDirectory())) {
+    std::string ext = de.path().extension().string();
+    if (de.path().stem() != keep &&
+        (ext == ".pack" || ext == ".idx" || ext == ".promisor"))
+      std::filesystem::remove(de.path());
+  }
+  return removed;
+}
+
+void gc(int window, int depth, int threads) {
+  std::vector<std::string> tips = list_branch_tips();
+  std::vector<PackObject> objects = collect_reachable(tips, read_index());
+  if (objects.empty()) {
+    std::cout << "Nothing to pack\n";
+    return;
+  }
+  std::cout << "Counting objects: " << objects.size() << ", done.\n";
+
+  // Group by type and name so similar objects share a window
+  std::vector<int> order(objects.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = static_cast<int>(i);
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    if (objects[a].type != objects[b].type)
+      return objects[a].type < objects[b].type;
+    if (objects[a].nameHash != objects[b].nameHash)
+      return objects[a].nameHash < objects[b].nameHash;
+    return a < b;
+  });
+
+  size_t workers = std::max<size_t>(
+      1, std::min<size_t>(threads, order.size() / (window + 1) + 1));
+  std::cout << "Delta compression using up to " << workers << " threads\n";
+  size_t target = std::max<size_t>(order.size() / (workers * 4), 16);
+  ThreadPool pool(workers);
+  for (const auto &[begin, end] : delta_segments(objects, order, target))
+    pool.submit([&, begin = begin, end = end] {
+      delta_search(objects, order, begin, end, window, depth);
+    });
+  pool.wait();
+
+  size_t deltas = std::count_if(objects.begin(), objects.end(),
+                                [](const PackObject &o) { return o.base >= 0; });
+  std::string packName = write_pack(objects);
+  // The new pack replaces any promisor packs, so it inherits the mark
+  if (has_promisor_remote())
+    mark_promisor_pack(packName);
+  size_t pruned = prune_packed(objects, packName);
+
+  write_commit_graph(tips);
+
+  std::cout << "Packed " << objects.size() << " objects (" << deltas
+            << " deltas) into pack-" << packName << ".pack\n";
+  std::cout << "Removed " << pruned << " loose objects\n";
+}
+
+// ---------------------------------------------------------------------------
+// Command entry point
+// ---------------------------------------------------------------------------
+
+int cmd_gc(int argc, char *argv[]) {
+  if (!std::filesystem::exists(".verz")) {
+    std::cerr << "fatal: not a verz repository\n";
+    return EXIT_FAILURE;
+  }
+
+  int window = 10;
+  int depth = 50;
+  int threads = static_cast<int>(std::thread::hardware_concurrency());
+  if (threads <= 0)
+    threads = 1;
+
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    try {
+      if (arg.rfind("--window=", 0) == 0) {
+        window = std::stoi(arg.substr(9));
+      } else if (arg.rfind("--depth=", 0) == 0) {
+        depth = std::stoi(arg.substr(8));
+      } else if (arg.rfind("--threads=", 0) == 0) {
+        threads = std::stoi(arg.substr(10));
+      } else {
+        throw std::invalid_argument(arg);
+      }
+    } catch (const std::exception &) {
+      std::cerr << "Usage: verz " << argv[1]
+                << " [--window=<n>] [--depth=<n>] [--threads=<n>]\n";
+      return EXIT_FAILURE;
+    }
+  }
+  if (window < 0 || depth < 0 || threads < 1) {
+    std::cerr << "fatal: window and depth must be >= 0, threads >= 1\n";
+    return EXIT_FAILURE;
+  }
+
+  try {
+    gc(window, depth, threads);
+  } catch (const std::exception &e) {
+    std::cerr << "error: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
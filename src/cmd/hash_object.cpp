@@ -1,36 +1,74 @@
 #include "../../include/hash_object.h"
 #include "../../include/utils.h"
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <unistd.h>
 
 void hash_object(std::string path, std::string flag) {
-  std::ifstream file(path, std::ios::binary);
-  if (!file) {
-    throw std::runtime_error("Failed to open file\n");
-  }
-  std::string content{std::istreambuf_iterator<char>(file),
-                      std::istreambuf_iterator<char>()};
-  file.close();
-
   bool shouldWrite = (flag == "-w");
-  std::string hash = createBlobObject(content, shouldWrite);
+  std::string hash = createBlobFromFile(path, shouldWrite);
 
   std::cout << hash << "\n";
 }
 
+// The blob header needs the size up front, so stdin is first spooled to a
+// temporary file; memory use stays constant either way
+void hash_object_stdin(std::string flag) {
+  std::string tmpPath = (std::filesystem::temp_directory_path() /
+                         ("verz_stdin_" + std::to_string(getpid())))
+                            .string();
+  std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+  if (!out)
+    throw std::runtime_error("Cannot write " + tmpPath);
+
+  try {
+    char buffer[64 * 1024];
+    while (std::cin.read(buffer, sizeof(buffer)) || std::cin.gcount() > 0)
+      out.write(buffer, std::cin.gcount());
+    out.close();
+    if (!out)
+      throw std::runtime_error("Cannot write " + tmpPath);
+    hash_object(tmpPath, flag);
+  } catch (...) {
+    std::filesystem::remove(tmpPath);
+    throw;
+  }
+  std::filesystem::remove(tmpPath);
+}
+
 int cmd_hash_object(int argc, char *argv[]) {
   std::string flag = "";
   std::string filePath = "";
+  bool fromStdin = false;
+
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-w") {
+      flag = "-w";
+    } else if (arg == "--stdin") {
+      fromStdin = true;
+    } else if (filePath.empty()) {
+      filePath = "./" + arg;
+    } else {
+      filePath.clear();
+      fromStdin = false;
+      break;
+    }
+  }
+  if (fromStdin == !filePath.empty()) {
+    std::cerr << "Usage : verz hash-object [-w] (--stdin | <file>)\n";
+    return EXIT_FAILURE;
+  }
 
-  if (argc >= 4 && std::string(argv[2]) == "-w") {
-    flag = "-w";
-    filePath = "./" + std::string(argv[3]);
-  } else if (argc == 3) {
-    filePath = "./" + std::string(argv[2]);
-  } else {
-    std::cerr << "Usage : verz hash-object [-w] <file>\n";
+  try {
+    if (fromStdin)
+      hash_object_stdin(flag);
+    else
+      hash_object(filePath, flag);
+  } catch (const std::exception &e) {
+    std::cerr << "fatal: " << e.what() << "\n";
     return EXIT_FAILURE;
   }
-  hash_object(filePath, flag);
   return EXIT_SUCCESS;
 }
@@ -1,5 +1,6 @@
 #include "../../include/log.h"
 #include "../../include/commit.h"
+#include "../../include/commit_graph.h"
 #include "../../include/utils.h"
 #include <cstdlib>
 #include <filesystem>
@@ -30,8 +31,13 @@ static void walk_log(int maxCount) {
     if (maxCount > 0 && count >= maxCount)
       break;
 
+    // Parents come from the commit-graph when it covers this commit; the
+    // object itself is only read for the author and message text
+    CommitInfo info;
     std::string raw;
     try {
+      if (!read_commit_info(sha, info))
+        throw std::runtime_error("not a commit");
       raw = readGitObject(sha);
     } catch (const std::exception &e) {
       std::cerr << "error: cannot read commit " << sha << "\n";
@@ -43,7 +49,7 @@ static void walk_log(int maxCount) {
       break;
     std::string body = raw.substr(nullPos + 1);
 
-    std::string parent = parse_field(body, "parent ");
+    std::string parent = info.parents.empty() ? "" : info.parents[0].hex();
     std::string author = parse_field(body, "author ");
 
     // Message is everything after the first blank line
@@ -1,4 +1,5 @@
 #include "../../include/ls_tree.h"
+#include "../../include/object_id.h"
 #include "../../include/utils.h"
 #include <iostream>
 #include <vector>
@@ -20,6 +21,18 @@ int cmd_ls_tree(int argc, char *argv[]) {
 }
 
 void ls_tree(std::string hash, std::string flag, std::string prefix) {
+  // Checked from the header first, so a large blob is never inflated
+  std::string objectType;
+  uint64_t objectSize;
+  if (!readObjectInfo(hash, objectType, objectSize)) {
+    std::cerr << "Not a valid object name " << hash << "\n";
+    exit(-1);
+  }
+  if (objectType != "tree") {
+    std::cerr << "Not a tree object (type was: " << objectType << ")\n";
+    exit(-1);
+  }
+
   std::string decompressed = readGitObject(hash);
 
   size_t nullPos = decompressed.find('\0');
@@ -55,8 +68,8 @@ void ls_tree(std::string hash, std::string flag, std::string prefix) {
     if (nameNull + 1 + 20 > decompressed.size())
       break;
 
-    std::string binarySha = decompressed.substr(nameNull + 1, 20);
-    std::string hexHash = binaryToHex(binarySha);
+    std::string hexHash =
+        ObjectId::from_raw(decompressed.data() + nameNull + 1).hex();
 
     std::string type = (mode == "40000" || mode == "040000") ? "tree" : "blob";
 
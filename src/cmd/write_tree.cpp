@@ -1,48 +1,195 @@
 #include "../../include/write_tree.h"
+#include "../../include/add.h"
+#include "../../include/thread_pool.h"
 #include "../../include/utils.h"
+#include <atomic>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <map>
+#include <memory>
 #include <vector>
 
 int cmd_write_tree() {
-  std::string hash = write_tree(std::filesystem::current_path());
+  std::string hash;
+  try {
+    hash = write_tree(std::filesystem::current_path());
+  } catch (const std::exception &e) {
+    std::cerr << "fatal: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
   std::cout << hash << std::endl;
   return EXIT_SUCCESS;
 }
 
-std::string write_tree(std::filesystem::path path) {
-
+// One directory of a parallel write_tree. Every child (file or
+// subdirectory) owns a slot in `entries`; whichever task fills the last slot
+// assembles this tree and reports it to the parent.
+struct TreeBuild {
   std::vector<TreeEntry> entries;
-  for (const auto &entry : std::filesystem::directory_iterator(path)) {
-    std::string name = entry.path().filename().string();
-    if (name == ".verz") {
+  std::vector<std::unique_ptr<TreeBuild>> subdirs;
+  std::atomic<size_t> pending{1}; // children plus the scanning task
+  TreeBuild *parent = nullptr;
+  size_t slot = 0;
+  ObjectId oid;
+  std::atomic<bool> failed{false}; // a child could not be read
+};
+
+// Completes one slot of `node`. A failed node is never assembled, and its
+// failure is passed up, so no tree missing an entry reaches the store.
+static void finish_child(TreeBuild *node) {
+  while (node && --node->pending == 0) {
+    if (node->failed) {
+      if (node->parent)
+        node->parent->failed = true;
+      node = node->parent;
       continue;
     }
+    std::sort(node->entries.begin(), node->entries.end());
+    std::string tree_content;
+    for (const auto &e : node->entries) {
+      tree_content += e.mode + " " + e.name + '\0';
+      tree_content += e.oid.raw();
+    }
+    node->oid = createTreeId(tree_content, /*write=*/true);
+    if (node->parent)
+      node->parent->entries[node->slot].oid = node->oid;
+    node = node->parent;
+  }
+}
 
-    TreeEntry tree_entry;
-    tree_entry.name = name;
+static void scan_dir(ThreadPool &pool, TreeBuild *node,
+                     const std::filesystem::path &path) {
+  // Size every slot before any child task can write into one
+  std::vector<std::filesystem::path> paths;
+  try {
+    for (const auto &entry : std::filesystem::directory_iterator(path)) {
+      std::string name = entry.path().filename().string();
+      if (name == ".verz") {
+        continue;
+      }
+
+      TreeEntry tree_entry;
+      tree_entry.name = name;
+      if (std::filesystem::is_directory(entry.path())) {
+        tree_entry.mode = "040000";
+      } else if (!std::filesystem::is_regular_file(entry.path())) {
+        // FIFOs, sockets, devices and dangling links have no blob content
+        continue;
+      } else {
+        std::filesystem::perms perms = entry.status().permissions();
+        bool is_exec = (perms & std::filesystem::perms::owner_exec) !=
+                       std::filesystem::perms::none;
+        tree_entry.mode = is_exec ? "100755" : "100644";
+      }
+      node->entries.push_back(tree_entry);
+      paths.push_back(entry.path());
+    }
+  } catch (...) {
+    node->failed = true;
+    finish_child(node);
+    throw;
+  }
+  node->pending += node->entries.size();
 
-    if (std::filesystem::is_directory(entry.path())) {
-      tree_entry.mode = "040000";
-      tree_entry.sha_hex = write_tree(entry.path());
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (node->entries[i].mode == "040000") {
+      auto child = std::make_unique<TreeBuild>();
+      child->parent = node;
+      child->slot = i;
+      TreeBuild *raw = child.get();
+      node->subdirs.push_back(std::move(child));
+      pool.submit([&pool, raw, p = paths[i]] { scan_dir(pool, raw, p); });
     } else {
-      std::filesystem::perms perms = entry.status().permissions();
-      bool is_exec = (perms & std::filesystem::perms::owner_exec) !=
-                     std::filesystem::perms::none;
-      tree_entry.mode = is_exec ? "100755" : "100644";
-      std::ifstream file(entry.path(), std::ios::binary);
-      std::string content((std::istreambuf_iterator<char>(file)),
-                          std::istreambuf_iterator<char>());
-      tree_entry.sha_hex = createBlobObject(content, /*write=*/true);
+      // The slot is completed even if the file cannot be read (it may have
+      // been removed or made unreadable since the scan); the error then
+      // reaches write_tree through the pool
+      pool.submit([node, i, p = paths[i]] {
+        try {
+          node->entries[i].oid =
+              createBlobIdFromFile(p.string(), /*write=*/true);
+        } catch (...) {
+          node->failed = true;
+          finish_child(node);
+          throw;
+        }
+        finish_child(node);
+      });
+    }
+  }
+  finish_child(node); // scanning done
+}
+
+std::string write_tree(std::filesystem::path path) {
+  TreeBuild root;
+  ThreadPool pool;
+  pool.submit([&pool, &root, &path] { scan_dir(pool, &root, path); });
+  pool.wait();
+  return root.oid.hex();
+}
+
+// Builds the tree for entries[begin, end), which all share a directory
+// prefix of `prefixLen` bytes, reusing `node` when it is still valid
+static ObjectId build_index_tree(const std::vector<IndexEntry> &entries,
+                                 size_t begin, size_t end, size_t prefixLen,
+                                 CacheTree &node) {
+  if (node.entryCount >= 0 && !node.oid.is_null() &&
+      objectExists(node.oid))
+    return node.oid;
+
+  std::vector<TreeEntry> tree_entries;
+  std::map<std::string, CacheTree> children;
+  size_t i = begin;
+  while (i < end) {
+    const std::string &path = entries[i].path;
+    size_t slash = path.find('/', prefixLen);
+    if (slash == std::string::npos) {
+      TreeEntry tree_entry;
+      tree_entry.mode = entries[i].mode;
+      tree_entry.name = path.substr(prefixLen);
+      tree_entry.oid = entries[i].oid;
+      tree_entries.push_back(tree_entry);
+      i++;
+      continue;
     }
 
-    entries.push_back(tree_entry);
+    // A subdirectory's entries are contiguous in the sorted index
+    std::string name = path.substr(prefixLen, slash - prefixLen);
+    size_t j = i + 1;
+    while (j < end && entries[j].path.compare(0, slash + 1, path, 0,
+                                              slash + 1) == 0)
+      j++;
+
+    CacheTree &child = children[name];
+    auto old = node.children.find(name);
+    if (old != node.children.end())
+      child = std::move(old->second);
+    if (child.entryCount != static_cast<int>(j - i))
+      child.entryCount = -1;
+
+    TreeEntry tree_entry;
+    tree_entry.mode = "040000";
+    tree_entry.name = name;
+    tree_entry.oid = build_index_tree(entries, i, j, slash + 1, child);
+    tree_entries.push_back(tree_entry);
+    i = j;
   }
-  std::sort(entries.begin(), entries.end());
+
+  std::sort(tree_entries.begin(), tree_entries.end());
   std::string tree_content;
-  for (const auto &e : entries) {
-    tree_content += e.mode + " " + e.name + '\0' + hexToBinary(e.sha_hex);
+  for (const auto &e : tree_entries) {
+    tree_content += e.mode + " " + e.name + '\0';
+    tree_content += e.oid.raw();
   }
-  return createTreeObject(tree_content, /*write=*/true);
-}
\ No newline at end of file
+
+  node.children = std::move(children);
+  node.entryCount = static_cast<int>(end - begin);
+  node.oid = createTreeId(tree_content, /*write=*/true);
+  return node.oid;
+}
+
+std::string write_tree_from_index(Index &index) {
+  const auto &entries = index.entries();
+  return build_index_tree(entries, 0, entries.size(), 0, index.cache_tree())
+      .hex();
+}
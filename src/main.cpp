@@ -4,6 +4,8 @@
 #include "../include/clone.h"
 #include "../include/commit.h"
 #include "../include/commit_tree.h"
+#include "../include/fetch.h"
+#include "../include/gc.h"
 #include "../include/hash_object.h"
 #include "../include/init.h"
 #include "../include/log.h"
@@ -79,6 +81,14 @@ int main(int argc, char *argv[]) {
     return cmd_clone(argc, argv);
   }
 
+  if (command == "fetch") {
+    return cmd_fetch(argc, argv);
+  }
+
+  if (command == "gc" || command == "repack") {
+    return cmd_gc(argc, argv);
+  }
+
   std::cerr << "Unknown command\n";
   return 1;
 }
@@ -0,0 +1,118 @@
+#include "../../include/checkout.h"
+#include "../../include/pack.h"
+#include "../../include/promisor.h"
+#include "../../include/thread_pool.h"
+#include "../../include/utils.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <tuple>
+
+// Files per pool task: large enough that consecutive pack reads stay
+// sequential, small enough for idle workers to steal
+static const size_t CHECKOUT_BATCH = 64;
+
+void gather_tree(const ObjectId &tree, const std::string &prefix,
+                 std::vector<CheckoutEntry> &out) {
+  std::string rawTree = readGitObject(tree);
+  size_t pos = rawTree.find('\0');
+  if (pos == std::string::npos)
+    throw std::runtime_error("Malformed tree object: " + tree.hex());
+  pos++;
+
+  while (pos < rawTree.size()) {
+    // <mode> SP <name> NUL <20-byte sha>
+    size_t spacePos = rawTree.find(' ', pos);
+    size_t nullPos = rawTree.find('\0', spacePos);
+    if (spacePos == std::string::npos || nullPos == std::string::npos ||
+        nullPos + 21 > rawTree.size())
+      throw std::runtime_error("Malformed tree object: " + tree.hex());
+    std::string mode = rawTree.substr(pos, spacePos - pos);
+    std::string name = rawTree.substr(spacePos + 1, nullPos - spacePos - 1);
+    ObjectId sha = ObjectId::from_raw(rawTree.data() + nullPos + 1);
+    pos = nullPos + 21;
+
+    if (mode == "40000" || mode == "040000")
+      gather_tree(sha, prefix + name + "/", out);
+    else if (mode != "160000") // submodules are not checked out
+      out.push_back({prefix + name, sha, mode});
+  }
+}
+
+static void write_entry(const CheckoutEntry &entry) {
+  std::string rawBlob = readGitObject(entry.oid);
+  size_t blobNull = rawBlob.find('\0');
+  size_t start = blobNull != std::string::npos ? blobNull + 1 : 0;
+
+  std::ofstream out(entry.path, std::ios::binary | std::ios::trunc);
+  if (!out)
+    throw std::runtime_error("Cannot write: " + entry.path);
+  out.write(rawBlob.data() + start, rawBlob.size() - start);
+  out.close();
+
+  std::filesystem::perms exec = std::filesystem::perms::owner_exec |
+                                std::filesystem::perms::group_exec |
+                                std::filesystem::perms::others_exec;
+  std::filesystem::permissions(entry.path, exec,
+                               entry.mode == "100755"
+                                   ? std::filesystem::perm_options::add
+                                   : std::filesystem::perm_options::remove);
+}
+
+void checkout_entries(std::vector<CheckoutEntry> entries) {
+  // A partial clone may lack the blobs; fetch them in one request instead
+  // of one per worker
+  if (has_promisor_remote()) {
+    std::vector<ObjectId> ids;
+    ids.reserve(entries.size());
+    for (const auto &e : entries)
+      ids.push_back(e.oid);
+    fetch_promised_objects(ids);
+  }
+
+  if (entries.empty())
+    return;
+
+  // Directories up front, so workers never race to create them
+  std::set<std::filesystem::path> dirs;
+  for (const auto &entry : entries) {
+    std::filesystem::path parent = std::filesystem::path(entry.path).parent_path();
+    if (!parent.empty())
+      dirs.insert(parent);
+  }
+  for (const auto &dir : dirs)
+    std::filesystem::create_directories(dir);
+
+  // Packed blobs in pack order (delta bases come before their deltas and
+  // stay in the base cache); loose objects after them
+  struct Keyed {
+    bool loose;
+    std::string pack;
+    uint64_t offset;
+    size_t index;
+  };
+  std::vector<Keyed> order;
+  order.reserve(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    Keyed k{true, "", 0, i};
+    if (!std::filesystem::exists(getObjectPath(entries[i].oid)))
+      k.loose = !packedObjectOffset(entries[i].oid, k.pack, k.offset);
+    order.push_back(std::move(k));
+  }
+  std::sort(order.begin(), order.end(), [](const Keyed &a, const Keyed &b) {
+    return std::tie(a.loose, a.pack, a.offset, a.index) <
+           std::tie(b.loose, b.pack, b.offset, b.index);
+  });
+
+  ThreadPool pool;
+  for (size_t begin = 0; begin < order.size(); begin += CHECKOUT_BATCH) {
+    size_t end = std::min(order.size(), begin + CHECKOUT_BATCH);
+    pool.submit([&entries, &order, begin, end] {
+      for (size_t i = begin; i < end; i++)
+        write_entry(entries[order[i].index]);
+    });
+  }
+  pool.wait();
+}
@@ -0,0 +1,460 @@
+#include "../../include/commit_graph.h"
+#include "../../include/object_id.h"
+#include "../../include/utils.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <openssl/sha.h>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+// Git commit-graph file, version 1:
+//   "CGPH" | version 1 | hash version 1 | chunk count | base graphs 0
+//   chunk table of (4-byte id, 8-byte offset), terminated by a zero id
+//   OIDF fanout, OIDL sorted names, CDAT per-commit data, EDGE extra parents
+//   SHA1 of everything above
+
+static const uint32_t GRAPH_PARENT_NONE = 0x70000000u;
+static const uint32_t GRAPH_EXTRA_EDGES = 0x80000000u;
+static const uint32_t GRAPH_LAST_EDGE = 0x80000000u;
+static const size_t GRAPH_DATA_WIDTH = 36;
+
+static uint32_t get_be32(const uint8_t *b) {
+  return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) |
+         (uint32_t(b[2]) << 8) | (uint32_t(b[3]));
+}
+
+static void put_be32(std::string &out, uint32_t v) {
+  out.push_back(static_cast<char>(v >> 24));
+  out.push_back(static_cast<char>(v >> 16));
+  out.push_back(static_cast<char>(v >> 8));
+  out.push_back(static_cast<char>(v));
+}
+
+static void put_be64(std::string &out, uint64_t v) {
+  put_be32(out, static_cast<uint32_t>(v >> 32));
+  put_be32(out, static_cast<uint32_t>(v));
+}
+
+std::string commitGraphPath() { return ".verz/objects/info/commit-graph"; }
+
+// ---------------------------------------------------------------------------
+// Reader
+// ---------------------------------------------------------------------------
+
+struct CommitGraph {
+  bool loaded = false;
+  std::vector<uint8_t> data;
+  uint32_t count = 0;
+  const uint8_t *fanout = nullptr;
+  const uint8_t *oids = nullptr;
+  const uint8_t *commits = nullptr;
+  const uint8_t *edges = nullptr;
+  size_t edgeCount = 0;
+};
+
+static CommitGraph &graph() {
+  static CommitGraph g;
+  return g;
+}
+
+// Checks the header, chunk table, chunk sizes, fanout and checksum of
+// g.data and points the chunk pointers into it; false if anything is off
+static bool parse_graph(CommitGraph &g) {
+  const uint8_t *d = g.data.data();
+  size_t size = g.data.size();
+  if (size < 8 + 12 + 20 || std::memcmp(d, "CGPH", 4) != 0 || d[4] != 1 ||
+      d[5] != 1)
+    return false;
+
+  unsigned char checksum[20];
+  SHA1(d, size - 20, checksum);
+  if (std::memcmp(checksum, d + size - 20, 20) != 0)
+    return false;
+
+  // The table has one row per chunk plus a terminating row holding the end
+  // offset, so each chunk's length is the next row's offset minus its own
+  size_t chunks = d[6];
+  size_t tableEnd = 8 + (chunks + 1) * 12;
+  if (tableEnd > size - 20)
+    return false;
+  auto row_offset = [&](size_t i) {
+    const uint8_t *row = d + 8 + i * 12;
+    return (uint64_t(get_be32(row + 4)) << 32) | get_be32(row + 8);
+  };
+  size_t oidlSize = 0, cdatSize = 0, edgeSize = 0;
+  for (size_t i = 0; i < chunks; i++) {
+    const uint8_t *row = d + 8 + i * 12;
+    uint64_t off = row_offset(i);
+    uint64_t end = row_offset(i + 1);
+    if (off < tableEnd || end < off || end > size - 20)
+      return false;
+    size_t len = static_cast<size_t>(end - off);
+    if (std::memcmp(row, "OIDF", 4) == 0) {
+      if (len != 256 * 4)
+        return false;
+      g.fanout = d + off;
+    } else if (std::memcmp(row, "OIDL", 4) == 0) {
+      g.oids = d + off;
+      oidlSize = len;
+    } else if (std::memcmp(row, "CDAT", 4) == 0) {
+      g.commits = d + off;
+      cdatSize = len;
+    } else if (std::memcmp(row, "EDGE", 4) == 0) {
+      g.edges = d + off;
+      edgeSize = len;
+    }
+  }
+  if (!g.fanout || !g.oids || !g.commits)
+    return false;
+
+  uint32_t prev = 0;
+  for (int i = 0; i < 256; i++) {
+    uint32_t n = get_be32(g.fanout + i * 4);
+    if (n < prev)
+      return false;
+    prev = n;
+  }
+  g.count = prev;
+  g.edgeCount = edgeSize / 4;
+  return oidlSize >= size_t(g.count) * 20 &&
+         cdatSize >= size_t(g.count) * GRAPH_DATA_WIDTH;
+}
+
+static void load_graph() {
+  CommitGraph &g = graph();
+  if (g.loaded)
+    return;
+  g = CommitGraph{};
+  g.loaded = true;
+
+  std::ifstream f(commitGraphPath(), std::ios::binary);
+  if (!f)
+    return;
+  g.data.assign(std::istreambuf_iterator<char>(f),
+                std::istreambuf_iterator<char>());
+  // A damaged graph is ignored; lookups fall back to the commit objects
+  if (!parse_graph(g)) {
+    g = CommitGraph{};
+    g.loaded = true;
+  }
+}
+
+static bool graph_position(const ObjectId &id, uint32_t &pos) {
+  const CommitGraph &g = graph();
+  if (!g.count)
+    return false;
+  uint8_t first = id.bytes[0];
+  uint32_t lo = first == 0 ? 0 : get_be32(g.fanout + (first - 1) * 4);
+  uint32_t hi = get_be32(g.fanout + first * 4);
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp = std::memcmp(g.oids + size_t(mid) * 20, id.bytes.data(), 20);
+    if (cmp == 0) {
+      pos = mid;
+      return true;
+    }
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return false;
+}
+
+static ObjectId graph_oid(uint32_t pos) {
+  return ObjectId::from_raw(graph().oids + size_t(pos) * 20);
+}
+
+// False if a parent position or edge index points outside the graph
+static bool fill_from_graph(uint32_t pos, CommitInfo &info) {
+  const CommitGraph &g = graph();
+  const uint8_t *row = g.commits + size_t(pos) * GRAPH_DATA_WIDTH;
+
+  info.sha = graph_oid(pos);
+  info.tree = ObjectId::from_raw(row);
+  info.parents.clear();
+
+  uint32_t p1 = get_be32(row + 20);
+  uint32_t p2 = get_be32(row + 24);
+  if (p1 != GRAPH_PARENT_NONE) {
+    if (p1 >= g.count)
+      return false;
+    info.parents.push_back(graph_oid(p1));
+  }
+  if (p2 & GRAPH_EXTRA_EDGES) {
+    for (size_t i = p2 & ~GRAPH_EXTRA_EDGES;; i++) {
+      if (i >= g.edgeCount)
+        return false;
+      uint32_t e = get_be32(g.edges + i * 4);
+      if ((e & ~GRAPH_LAST_EDGE) >= g.count)
+        return false;
+      info.parents.push_back(graph_oid(e & ~GRAPH_LAST_EDGE));
+      if (e & GRAPH_LAST_EDGE)
+        break;
+    }
+  } else if (p2 != GRAPH_PARENT_NONE) {
+    if (p2 >= g.count)
+      return false;
+    info.parents.push_back(graph_oid(p2));
+  }
+
+  uint32_t genHigh = get_be32(row + 28);
+  info.generation = genHigh >> 2;
+  info.commitTime = (uint64_t(genHigh & 0x3) << 32) | get_be32(row + 32);
+  return true;
+}
+
+static bool parse_commit_object(const ObjectId &id, CommitInfo &info) {
+  std::string raw;
+  try {
+    raw = readGitObject(id);
+  } catch (const std::exception &) {
+    return false;
+  }
+  size_t nul = raw.find('\0');
+  if (nul == std::string::npos || raw.compare(0, 7, "commit ") != 0)
+    return false;
+
+  info = CommitInfo{};
+  info.sha = id;
+  bool hasTree = false;
+  size_t pos = nul + 1;
+  while (pos < raw.size() && raw[pos] != '\n') {
+    size_t eol = raw.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = raw.size();
+    ObjectId oid;
+    if (raw.compare(pos, 5, "tree ") == 0) {
+      hasTree = ObjectId::parse_hex(std::string_view(raw).substr(pos + 5, 40),
+                                    info.tree);
+    } else if (raw.compare(pos, 7, "parent ") == 0) {
+      if (!ObjectId::parse_hex(std::string_view(raw).substr(pos + 7, 40), oid))
+        return false;
+      info.parents.push_back(oid);
+    } else if (raw.compare(pos, 10, "committer ") == 0) {
+      // "... <timestamp> <tz>"
+      size_t tzSpace = raw.rfind(' ', eol - 1);
+      size_t tsSpace = raw.rfind(' ', tzSpace - 1);
+      try {
+        info.commitTime =
+            std::stoull(raw.substr(tsSpace + 1, tzSpace - tsSpace - 1));
+      } catch (...) {
+      }
+    }
+    pos = eol + 1;
+  }
+  return hasTree;
+}
+
+bool read_commit_info(const ObjectId &id, CommitInfo &info) {
+  load_graph();
+  uint32_t pos;
+  if (!(graph_position(id, pos) && fill_from_graph(pos, info)) &&
+      !parse_commit_object(id, info)) {
+    return false;
+  }
+  // Commits on the shallow boundary are grafted to have no parents
+  if (shallow_commits().count(id))
+    info.parents.clear();
+  return true;
+}
+
+bool read_commit_info(const std::string &sha, CommitInfo &info) {
+  ObjectId id;
+  return ObjectId::parse_hex(sha, id) && read_commit_info(id, info);
+}
+
+// ---------------------------------------------------------------------------
+// Shallow boundary
+// ---------------------------------------------------------------------------
+
+std::string shallowPath() { return ".verz/shallow"; }
+
+static std::unordered_set<ObjectId> &shallow_cache(bool reload) {
+  static std::unordered_set<ObjectId> commits;
+  static bool loaded = false;
+  if (!loaded || reload) {
+    commits.clear();
+    std::ifstream f(shallowPath());
+    std::string line;
+    ObjectId id;
+    while (std::getline(f, line))
+      if (ObjectId::parse_hex(line, id))
+        commits.insert(id);
+    loaded = true;
+  }
+  return commits;
+}
+
+const std::unordered_set<ObjectId> &shallow_commits() {
+  return shallow_cache(false);
+}
+
+void write_shallow(const std::set<ObjectId> &commits) {
+  if (commits.empty()) {
+    std::filesystem::remove(shallowPath());
+  } else {
+    std::string tmp = shallowPath() + ".lock";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    for (const auto &id : commits)
+      out << id.hex() << "\n";
+    out.close();
+    if (!out)
+      throw std::runtime_error("Cannot write " + tmp);
+    std::filesystem::rename(tmp, shallowPath());
+  }
+  shallow_cache(true);
+}
+
+// ---------------------------------------------------------------------------
+// Writer
+// ---------------------------------------------------------------------------
+
+bool write_commit_graph(const std::vector<std::string> &tips) {
+  load_graph();
+
+  // Generations below a graft would change if the history were deepened,
+  // so shallow repositories get no graph (as in Git)
+  if (!shallow_commits().empty()) {
+    std::filesystem::remove(commitGraphPath());
+    graph().loaded = false;
+    return false;
+  }
+
+  // Gather every reachable commit, reusing graph rows where possible
+  std::unordered_map<ObjectId, CommitInfo> commits;
+  std::vector<ObjectId> stack;
+  for (const auto &tip : tips)
+    stack.push_back(ObjectId::from_hex(tip));
+  while (!stack.empty()) {
+    ObjectId sha = stack.back();
+    stack.pop_back();
+    if (commits.count(sha))
+      continue;
+    CommitInfo info;
+    if (!read_commit_info(sha, info)) {
+      // Missing history (e.g. a shallow boundary): a partial graph would
+      // report wrong generations, so drop it entirely
+      std::filesystem::remove(commitGraphPath());
+      graph().loaded = false;
+      return false;
+    }
+    for (const auto &parent : info.parents)
+      if (!commits.count(parent))
+        stack.push_back(parent);
+    commits.emplace(sha, std::move(info));
+  }
+
+  // Generation numbers, computed bottom-up without recursion
+  for (auto &[sha, info] : commits) {
+    if (info.generation)
+      continue;
+    std::vector<ObjectId> work{sha};
+    while (!work.empty()) {
+      CommitInfo &cur = commits[work.back()];
+      uint32_t maxParent = 0;
+      bool ready = true;
+      for (const auto &parent : cur.parents) {
+        CommitInfo &p = commits[parent];
+        if (!p.generation) {
+          work.push_back(parent);
+          ready = false;
+        } else {
+          maxParent = std::max(maxParent, p.generation);
+        }
+      }
+      if (ready) {
+        cur.generation = std::min<uint32_t>(maxParent + 1, 0x3FFFFFFF);
+        work.pop_back();
+      }
+    }
+  }
+
+  std::vector<ObjectId> order;
+  order.reserve(commits.size());
+  for (const auto &entry : commits)
+    order.push_back(entry.first);
+  std::sort(order.begin(), order.end());
+  std::unordered_map<ObjectId, uint32_t> position;
+  for (size_t i = 0; i < order.size(); i++)
+    position[order[i]] = static_cast<uint32_t>(i);
+  auto parent_position = [&](const ObjectId &parent) {
+    return position[parent];
+  };
+
+  std::string oidf, oidl, cdat, edge;
+  uint32_t fanout[256] = {0};
+  for (const auto &id : order)
+    fanout[id.bytes[0]]++;
+  uint32_t running = 0;
+  for (int i = 0; i < 256; i++) {
+    running += fanout[i];
+    put_be32(oidf, running);
+  }
+
+  for (const auto &id : order) {
+    oidl += id.raw();
+    const CommitInfo &info = commits[id];
+    cdat += info.tree.raw();
+
+    const auto &parents = info.parents;
+    put_be32(cdat, parents.empty() ? GRAPH_PARENT_NONE
+                                   : parent_position(parents[0]));
+    if (parents.size() <= 1) {
+      put_be32(cdat, GRAPH_PARENT_NONE);
+    } else if (parents.size() == 2) {
+      put_be32(cdat, parent_position(parents[1]));
+    } else {
+      put_be32(cdat, GRAPH_EXTRA_EDGES | static_cast<uint32_t>(edge.size() / 4));
+      for (size_t i = 1; i < parents.size(); i++)
+        put_be32(edge, parent_position(parents[i]) |
+                           (i + 1 == parents.size() ? GRAPH_LAST_EDGE : 0));
+    }
+
+    uint64_t time = info.commitTime & 0x3FFFFFFFFull;
+    put_be32(cdat, (info.generation << 2) | static_cast<uint32_t>(time >> 32));
+    put_be32(cdat, static_cast<uint32_t>(time));
+  }
+
+  std::vector<std::pair<const char *, const std::string *>> chunks = {
+      {"OIDF", &oidf}, {"OIDL", &oidl}, {"CDAT", &cdat}};
+  if (!edge.empty())
+    chunks.push_back({"EDGE", &edge});
+
+  std::string out = "CGPH";
+  out.push_back(1); // version
+  out.push_back(1); // SHA-1
+  out.push_back(static_cast<char>(chunks.size()));
+  out.push_back(0); // no base graphs
+  uint64_t offset = out.size() + (chunks.size() + 1) * 12;
+  for (const auto &chunk : chunks) {
+    out.append(chunk.first, 4);
+    put_be64(out, offset);
+    offset += chunk.second->size();
+  }
+  out.append(4, '\0');
+  put_be64(out, offset);
+  for (const auto &chunk : chunks)
+    out += *chunk.second;
+
+  unsigned char checksum[20];
+  SHA1(reinterpret_cast<const unsigned char *>(out.data()), out.size(),
+       checksum);
+  out.append(reinterpret_cast<const char *>(checksum), 20);
+
+  std::filesystem::create_directories(
+      std::filesystem::path(commitGraphPath()).parent_path());
+  std::string tmpPath = commitGraphPath() + ".tmp";
+  std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+  if (!f)
+    throw std::runtime_error("Cannot write " + commitGraphPath());
+  f.write(out.data(), out.size());
+  f.close();
+  std::filesystem::rename(tmpPath, commitGraphPath());
+
+  graph().loaded = false; // pick up the new file on next lookup
+  return true;
+}
@@ -0,0 +1,619 @@
+#include "../../include/index_pack.h"
+#include "../../include/pack.h"
+#include "../../include/promisor.h"
+#include "../../include/thread_pool.h"
+#include "../../include/utils.h"
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <unordered_set>
+
+// Incoming bytes are fed through a state machine, one pack element at a
+// time:
+//   Header      "PACK" | version | object count
+//   EntryHeader type + inflated size varint
+//   OfsBase     negative offset varint (OFS_DELTA)
+//   RefBase     20-byte base name (REF_DELTA)
+//   Data        zlib stream, inflated incrementally
+//   Trailer     SHA1 of everything before it
+
+static uint32_t get_be32(const uint8_t *b) {
+  return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) |
+         (uint32_t(b[2]) << 8) | (uint32_t(b[3]));
+}
+
+static const size_t INFLATE_CHUNK = 64 * 1024;
+
+PackIndexer::PackIndexer(size_t deltaCacheLimit)
+    : deltaCacheLimit_(deltaCacheLimit), inflateBuf_(INFLATE_CHUNK) {
+  // A lazy fetch can start a second indexer while this one is running
+  std::filesystem::create_directories(packDirectory());
+  tmpPath_ = packTempPath("pack");
+  out_.open(tmpPath_, std::ios::binary | std::ios::trunc);
+  if (!out_)
+    throw std::runtime_error("Cannot write " + tmpPath_);
+
+  packHash_ = EVP_MD_CTX_new();
+  objectHash_ = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(packHash_, EVP_sha1(), nullptr);
+  if (inflateInit(&zs_) != Z_OK)
+    throw std::runtime_error("inflateInit failed");
+}
+
+PackIndexer::~PackIndexer() {
+  inflateEnd(&zs_);
+  EVP_MD_CTX_free(packHash_);
+  EVP_MD_CTX_free(objectHash_);
+  if (!finished_) {
+    out_.close();
+    std::error_code ec;
+    std::filesystem::remove(tmpPath_, ec);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Streaming parser
+// ---------------------------------------------------------------------------
+
+void PackIndexer::consume(const uint8_t *data, size_t len) {
+  if (state_ != State::Trailer)
+    EVP_DigestUpdate(packHash_, data, len);
+  if (state_ != State::Header && state_ != State::Trailer)
+    crc_ = crc32(crc_, data, static_cast<uInt>(len));
+  offset_ += len;
+}
+
+void PackIndexer::feed(const uint8_t *data, size_t len) {
+  out_.write(reinterpret_cast<const char *>(data), len);
+  if (!out_)
+    throw std::runtime_error("Cannot write " + tmpPath_);
+
+  size_t pos = 0;
+  while (pos < len) {
+    switch (state_) {
+    case State::Header: {
+      size_t n = std::min(len - pos, size_t(12) - scratch_.size());
+      scratch_.append(reinterpret_cast<const char *>(data + pos), n);
+      consume(data + pos, n);
+      pos += n;
+      if (scratch_.size() < 12)
+        break;
+      const uint8_t *h = reinterpret_cast<const uint8_t *>(scratch_.data());
+      if (std::memcmp(h, "PACK", 4) != 0)
+        throw std::runtime_error("Invalid pack header");
+      uint32_t version = get_be32(h + 4);
+      if (version != 2 && version != 3)
+        throw std::runtime_error("Unsupported pack version");
+      count_ = get_be32(h + 8);
+      entries_.reserve(count_);
+      scratch_.clear();
+      state_ = count_ ? State::EntryHeader : State::Trailer;
+      break;
+    }
+
+    case State::EntryHeader: {
+      uint8_t c = data[pos];
+      if (headerBytes_ == 0) {
+        cur_ = Entry{};
+        cur_.offset = offset_;
+        cur_.type = (c >> 4) & 0x07;
+        cur_.size = c & 0x0F;
+        crc_ = crc32(0L, Z_NULL, 0);
+        shift_ = 4;
+      } else {
+        if (shift_ > 63)
+          throw std::runtime_error("Bad pack entry header");
+        cur_.size |= uint64_t(c & 0x7F) << shift_;
+        shift_ += 7;
+      }
+      headerBytes_++;
+      consume(data + pos, 1);
+      pos++;
+      if (c & 0x80)
+        break;
+
+      headerBytes_ = 0;
+      if (cur_.type == PACK_OFS_DELTA) {
+        ofs_ = 0;
+        state_ = State::OfsBase;
+      } else if (cur_.type == PACK_REF_DELTA) {
+        state_ = State::RefBase;
+      } else if (cur_.type >= PACK_COMMIT && cur_.type <= PACK_TAG) {
+        begin_data();
+      } else {
+        throw std::runtime_error("Unknown object type");
+      }
+      break;
+    }
+
+    case State::OfsBase: {
+      // Same limit as parseEntryHeader: a distance only grows with each
+      // byte, so one already past the entry (or near overflowing the next
+      // shift) can never name a base
+      if (ofs_ > cur_.offset || ofs_ > (uint64_t(1) << 56))
+        throw std::runtime_error("Bad OFS_DELTA base");
+      uint8_t c = data[pos];
+      consume(data + pos, 1);
+      pos++;
+      ofs_ = (ofs_ << 7) | (c & 0x7F);
+      if (c & 0x80) {
+        ofs_++;
+        break;
+      }
+      if (ofs_ == 0 || ofs_ > cur_.offset)
+        throw std::runtime_error("Bad OFS_DELTA base");
+      cur_.baseOffset = cur_.offset - ofs_;
+      begin_data();
+      break;
+    }
+
+    case State::RefBase: {
+      size_t n = std::min(len - pos, size_t(20) - scratch_.size());
+      scratch_.append(reinterpret_cast<const char *>(data + pos), n);
+      consume(data + pos, n);
+      pos += n;
+      if (scratch_.size() == 20) {
+        cur_.baseSha = ObjectId::from_raw(scratch_.data());
+        scratch_.clear();
+        begin_data();
+      }
+      break;
+    }
+
+    case State::Data:
+      pos += inflate_some(data + pos, len - pos);
+      break;
+
+    case State::Trailer: {
+      size_t n = std::min(len - pos, size_t(20) - scratch_.size());
+      scratch_.append(reinterpret_cast<const char *>(data + pos), n);
+      consume(data + pos, n);
+      pos += n;
+      if (scratch_.size() < 20)
+        break;
+      unsigned char digest[20];
+      EVP_DigestFinal_ex(packHash_, digest, nullptr);
+      if (std::memcmp(digest, scratch_.data(), 20) != 0)
+        throw std::runtime_error("Pack checksum mismatch");
+      checksum_ = std::move(scratch_);
+      scratch_.clear();
+      state_ = State::Done;
+      break;
+    }
+
+    case State::Done:
+      throw std::runtime_error("Unexpected data after pack trailer");
+    }
+  }
+}
+
+void PackIndexer::begin_data() {
+  cur_.dataPos = offset_;
+  inflateReset(&zs_);
+  if (cur_.type <= PACK_TAG) {
+    // The entry header gives the size up front, so the object hash can be
+    // computed as the data streams through
+    std::string header =
+        packTypeName(cur_.type) + " " + std::to_string(cur_.size);
+    header += '\0';
+    EVP_DigestInit_ex(objectHash_, EVP_sha1(), nullptr);
+    EVP_DigestUpdate(objectHash_, header.data(), header.size());
+  }
+  state_ = State::Data;
+}
+
+size_t PackIndexer::inflate_some(const uint8_t *data, size_t len) {
+  zs_.next_in = const_cast<Bytef *>(data);
+  zs_.avail_in = static_cast<uInt>(
+      std::min<size_t>(len, std::numeric_limits<uInt>::max()));
+  uInt offered = zs_.avail_in;
+
+  int ret;
+  do {
+    zs_.next_out = inflateBuf_.data();
+    zs_.avail_out = static_cast<uInt>(inflateBuf_.size());
+    ret = inflate(&zs_, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      throw std::runtime_error("Corrupt pack entry at offset " +
+                               std::to_string(cur_.offset));
+    size_t produced = inflateBuf_.size() - zs_.avail_out;
+    if (produced && cur_.type <= PACK_TAG)
+      EVP_DigestUpdate(objectHash_, inflateBuf_.data(), produced);
+  } while (ret == Z_OK && (zs_.avail_in > 0 || zs_.avail_out == 0));
+
+  size_t used = offered - zs_.avail_in;
+  if (used == 0 && ret != Z_STREAM_END)
+    throw std::runtime_error("Corrupt pack entry at offset " +
+                             std::to_string(cur_.offset));
+  consume(data, used);
+  if (ret == Z_STREAM_END)
+    end_entry();
+  return used;
+}
+
+void PackIndexer::end_entry() {
+  if (zs_.total_out != cur_.size)
+    throw std::runtime_error("Pack entry size mismatch at offset " +
+                             std::to_string(cur_.offset));
+  cur_.crc = crc_;
+  if (cur_.type <= PACK_TAG) {
+    unsigned char digest[20];
+    EVP_DigestFinal_ex(objectHash_, digest, nullptr);
+    cur_.sha = ObjectId::from_raw(digest);
+    cur_.objectType = cur_.type;
+  }
+  entries_.push_back(std::move(cur_));
+  state_ = entries_.size() == count_ ? State::Trailer : State::EntryHeader;
+}
+
+// ---------------------------------------------------------------------------
+// Delta resolution and installation
+// ---------------------------------------------------------------------------
+
+// Size-capped LRU of resolved objects that are still waiting to have their
+// children resolved. Entries are shared so a task keeps its base alive even
+// if it is evicted meanwhile; evicted bases are rebuilt from the pack.
+class ResolvedCache {
+public:
+  explicit ResolvedCache(size_t limit) : limit_(limit) {}
+
+  std::shared_ptr<const std::vector<unsigned char>> get(size_t entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = map_.find(entry);
+    if (it == map_.end())
+      return nullptr;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->data;
+  }
+
+  void put(size_t entry,
+           std::shared_ptr<const std::vector<unsigned char>> data) {
+    if (data->size() > limit_ / 4)
+      return; // one huge blob should not flush everything else
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (map_.count(entry))
+      return;
+    bytes_ += data->size();
+    lru_.push_front({entry, std::move(data)});
+    map_[entry] = lru_.begin();
+    while (bytes_ > limit_ && !lru_.empty())
+      drop(std::prev(lru_.end()));
+  }
+
+  // Called once every child of `entry` is resolved
+  void erase(size_t entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = map_.find(entry);
+    if (it != map_.end())
+      drop(it->second);
+  }
+
+private:
+  struct Item {
+    size_t entry;
+    std::shared_ptr<const std::vector<unsigned char>> data;
+  };
+
+  void drop(std::list<Item>::iterator it) {
+    bytes_ -= it->data->size();
+    map_.erase(it->entry);
+    lru_.erase(it);
+  }
+
+  size_t limit_;
+  std::mutex mutex_;
+  std::list<Item> lru_;
+  std::unordered_map<size_t, std::list<Item>::iterator> map_;
+  size_t bytes_ = 0;
+};
+
+// Delta children of every object, keyed the two ways a delta can name its
+// base. Built before any task runs and read-only afterwards.
+struct PackIndexer::DeltaContext {
+  const uint8_t *pack;
+  size_t packSize;
+  ThreadPool &pool;
+  ResolvedCache cache;
+  std::unordered_map<uint64_t, std::vector<size_t>> ofsChildren;
+  std::unordered_map<ObjectId, std::vector<size_t>> refChildren;
+  // Entry each delta was resolved against, set before its children run
+  std::vector<size_t> baseOf;
+  // Guards against resolving a delta twice when its REF base occurs more
+  // than once in the pack
+  std::unique_ptr<std::atomic<bool>[]> claimed;
+};
+
+static bool is_delta(uint8_t type) {
+  return type == PACK_OFS_DELTA || type == PACK_REF_DELTA;
+}
+
+static ObjectId object_sha(uint8_t type,
+                              const std::vector<unsigned char> &object) {
+  std::string header =
+      packTypeName(type) + " " + std::to_string(object.size());
+  header += '\0';
+  unsigned char digest[20];
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(ctx, EVP_sha1(), nullptr);
+  EVP_DigestUpdate(ctx, header.data(), header.size());
+  EVP_DigestUpdate(ctx, object.data(), object.size());
+  EVP_DigestFinal_ex(ctx, digest, nullptr);
+  EVP_MD_CTX_free(ctx);
+  return ObjectId::from_raw(digest);
+}
+
+std::vector<unsigned char> PackIndexer::inflate_entry(const DeltaContext &ctx,
+                                                      const Entry &e) const {
+  std::vector<unsigned char> out;
+  if (!inflatePackData(ctx.pack + e.dataPos, ctx.packSize - e.dataPos, e.size,
+                       out))
+    throw std::runtime_error("Corrupt pack entry at offset " +
+                             std::to_string(e.offset));
+  return out;
+}
+
+bool PackIndexer::has_children(const DeltaContext &ctx, size_t i) const {
+  return ctx.ofsChildren.count(entries_[i].offset) ||
+         ctx.refChildren.count(entries_[i].sha);
+}
+
+// Only called before any task runs, while names are stable
+bool PackIndexer::has_unresolved_children(const DeltaContext &ctx,
+                                          size_t i) const {
+  auto unresolved = [this](const std::vector<size_t> &children) {
+    for (size_t c : children)
+      if (entries_[c].sha.is_null())
+        return true;
+    return false;
+  };
+  auto ofs = ctx.ofsChildren.find(entries_[i].offset);
+  if (ofs != ctx.ofsChildren.end() && unresolved(ofs->second))
+    return true;
+  auto ref = ctx.refChildren.find(entries_[i].sha);
+  return ref != ctx.refChildren.end() && unresolved(ref->second);
+}
+
+// Returns the resolved bytes of entry `i`. On a cache miss, walks up the
+// recorded bases to the nearest cached or undeltified one and re-applies
+// the deltas from the pack on the way back down.
+std::shared_ptr<const std::vector<unsigned char>>
+PackIndexer::base_data(DeltaContext &ctx, size_t i) {
+  std::shared_ptr<const std::vector<unsigned char>> data;
+  std::vector<size_t> chain;
+  for (size_t cur = i; !(data = ctx.cache.get(cur));
+       cur = ctx.baseOf[cur]) {
+    chain.push_back(cur);
+    if (!is_delta(entries_[cur].type))
+      break;
+  }
+
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    const Entry &e = entries_[*it];
+    data = std::make_shared<const std::vector<unsigned char>>(
+        data ? resolveDelta(*data, inflate_entry(ctx, e))
+             : inflate_entry(ctx, e));
+    ctx.cache.put(*it, data);
+  }
+  return data;
+}
+
+// Resolves every delta whose base is entry `base` and hands each resolved
+// child that is itself a base to a new task, so the pool walks all delta
+// trees at once. Resolved bytes are passed on through the cache only.
+void PackIndexer::resolve_children(DeltaContext &ctx, size_t base) {
+  std::shared_ptr<const std::vector<unsigned char>> data = base_data(ctx, base);
+  auto resolve = [&](size_t i) {
+    if (ctx.claimed[i].exchange(true))
+      return;
+    Entry &e = entries_[i];
+    auto object = std::make_shared<const std::vector<unsigned char>>(
+        resolveDelta(*data, inflate_entry(ctx, e)));
+    e.objectType = entries_[base].objectType;
+    e.sha = object_sha(e.objectType, *object);
+    ctx.baseOf[i] = base;
+    if (has_children(ctx, i)) {
+      ctx.cache.put(i, std::move(object));
+      ctx.pool.submit([this, &ctx, i] { resolve_children(ctx, i); });
+    }
+  };
+
+  auto ofs = ctx.ofsChildren.find(entries_[base].offset);
+  if (ofs != ctx.ofsChildren.end())
+    for (size_t i : ofs->second)
+      resolve(i);
+  auto ref = ctx.refChildren.find(entries_[base].sha);
+  if (ref != ctx.refChildren.end())
+    for (size_t i : ref->second)
+      resolve(i);
+  ctx.cache.erase(base);
+}
+
+void PackIndexer::resolve_deltas(const uint8_t *pack, size_t packSize) {
+  ThreadPool pool;
+  DeltaContext ctx{pack, packSize, pool, ResolvedCache(deltaCacheLimit_),
+                   {}, {}, std::vector<size_t>(entries_.size()), {}};
+  ctx.claimed.reset(new std::atomic<bool>[entries_.size()]());
+
+  std::unordered_set<uint64_t> offsets;
+  for (const auto &e : entries_)
+    offsets.insert(e.offset);
+  for (size_t i = 0; i < entries_.size(); i++) {
+    const Entry &e = entries_[i];
+    if (e.type == PACK_OFS_DELTA) {
+      if (!offsets.count(e.baseOffset))
+        throw std::runtime_error("Bad OFS_DELTA base at offset " +
+                                 std::to_string(e.offset));
+      ctx.ofsChildren[e.baseOffset].push_back(i);
+    } else if (e.type == PACK_REF_DELTA) {
+      ctx.refChildren[e.baseSha].push_back(i);
+    }
+  }
+
+  // Every named object with unresolved dependents roots one delta tree:
+  // the undeltified objects on the first pass, bases appended to a thin
+  // pack on later ones. Roots are picked before any task runs, as tasks
+  // fill in the deltas' names.
+  std::vector<size_t> roots;
+  for (size_t i = 0; i < entries_.size(); i++)
+    if (!entries_[i].sha.is_null() && has_unresolved_children(ctx, i))
+      roots.push_back(i);
+  for (size_t i : roots)
+    pool.submit([this, &ctx, i] { resolve_children(ctx, i); });
+  pool.wait();
+}
+
+// REF_DELTA bases named by unresolved deltas that no entry of the pack
+// provides
+std::vector<ObjectId> PackIndexer::missing_bases() const {
+  std::unordered_set<ObjectId> named, missing;
+  for (const auto &e : entries_)
+    if (!e.sha.is_null())
+      named.insert(e.sha);
+  for (const auto &e : entries_)
+    if (e.sha.is_null() && e.type == PACK_REF_DELTA && !named.count(e.baseSha))
+      missing.insert(e.baseSha);
+  return std::vector<ObjectId>(missing.begin(), missing.end());
+}
+
+// Appends whole copies of local objects to the spooled pack, as
+// `git index-pack --fix-thin` does, so the installed pack is self-contained.
+// Rewrites the object count and trailer; the pack name changes with them.
+void PackIndexer::append_bases(const std::vector<ObjectId> &shas) {
+  uint64_t end = offset_ - 20;
+  std::filesystem::resize_file(tmpPath_, end);
+  std::ofstream out(tmpPath_, std::ios::binary | std::ios::app);
+  for (const auto &sha : shas) {
+    std::string raw = readGitObject(sha);
+    size_t nul = raw.find('\0');
+    size_t space = raw.find(' ');
+    if (nul == std::string::npos || space > nul)
+      throw std::runtime_error("Malformed object: " + sha.hex());
+    Entry e;
+    e.offset = end;
+    e.type = e.objectType = packTypeCode(raw.substr(0, space));
+    e.size = raw.size() - nul - 1;
+    e.sha = sha;
+
+    std::string header;
+    uint64_t size = e.size;
+    uint8_t c = static_cast<uint8_t>((e.type << 4) | (size & 0x0F));
+    size >>= 4;
+    while (size) {
+      header.push_back(static_cast<char>(c | 0x80));
+      c = size & 0x7F;
+      size >>= 7;
+    }
+    header.push_back(static_cast<char>(c));
+    std::string data = zlibCompress(raw.substr(nul + 1));
+
+    e.dataPos = end + header.size();
+    e.crc = crc32(0L, Z_NULL, 0);
+    e.crc = crc32(e.crc, reinterpret_cast<const Bytef *>(header.data()),
+                  static_cast<uInt>(header.size()));
+    e.crc = crc32(e.crc, reinterpret_cast<const Bytef *>(data.data()),
+                  static_cast<uInt>(data.size()));
+    out.write(header.data(), header.size());
+    out.write(data.data(), data.size());
+    end += header.size() + data.size();
+    entries_.push_back(std::move(e));
+  }
+  out.close();
+
+  count_ = static_cast<uint32_t>(entries_.size());
+  std::fstream pack(tmpPath_, std::ios::binary | std::ios::in | std::ios::out);
+  const char count[4] = {char(count_ >> 24), char(count_ >> 16),
+                         char(count_ >> 8), char(count_)};
+  pack.seekp(8);
+  pack.write(count, 4);
+  pack.seekg(0);
+  EVP_DigestInit_ex(packHash_, EVP_sha1(), nullptr);
+  std::vector<char> buf(INFLATE_CHUNK);
+  while (pack.read(buf.data(), buf.size()) || pack.gcount() > 0)
+    EVP_DigestUpdate(packHash_, buf.data(), pack.gcount());
+  unsigned char digest[20];
+  EVP_DigestFinal_ex(packHash_, digest, nullptr);
+  checksum_.assign(reinterpret_cast<const char *>(digest), 20);
+  pack.clear();
+  pack.seekp(0, std::ios::end);
+  pack.write(checksum_.data(), 20);
+  pack.close();
+  if (!pack)
+    throw std::runtime_error("Cannot write " + tmpPath_);
+  offset_ = end + 20;
+}
+
+// Maps the spooled pack and resolves whatever deltas it can
+void PackIndexer::resolve_spooled_pack() {
+  int fd = open(tmpPath_.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Failed to open file: " + tmpPath_);
+  struct stat st;
+  fstat(fd, &st);
+  size_t packSize = static_cast<size_t>(st.st_size);
+  void *map = mmap(nullptr, packSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    throw std::runtime_error("Failed to map file: " + tmpPath_);
+  try {
+    resolve_deltas(static_cast<const uint8_t *>(map), packSize);
+  } catch (...) {
+    munmap(map, packSize);
+    throw;
+  }
+  munmap(map, packSize);
+}
+
+std::string PackIndexer::finish() {
+  if (state_ != State::Done)
+    throw std::runtime_error("Pack stream ended early");
+  out_.close();
+  if (!out_)
+    throw std::runtime_error("Cannot write " + tmpPath_);
+  resolve_spooled_pack();
+
+  // A thin pack's deltas may name bases we already have. Append those and
+  // resolve again; a base can be another such delta, hence the loop.
+  for (std::vector<ObjectId> missing; !(missing = missing_bases()).empty();
+       resolve_spooled_pack()) {
+    std::vector<ObjectId> local;
+    for (const auto &sha : missing)
+      if (objectExists(sha))
+        local.push_back(sha);
+    if (local.empty()) {
+      // Only a partial clone may lack what the server assumed we have
+      if (!fetch_promised_objects(missing))
+        break;
+      local = missing;
+    }
+    append_bases(local);
+  }
+
+  for (const auto &e : entries_) {
+    if (!e.sha.is_null())
+      continue;
+    throw std::runtime_error(
+        e.type == PACK_REF_DELTA
+            ? "REF_DELTA base not found: " + e.baseSha.hex()
+            : "Unresolvable delta at offset " + std::to_string(e.offset));
+  }
+
+  std::string name = binaryToHex(checksum_);
+  std::string packBase = packDirectory() + "/pack-" + name;
+  std::filesystem::rename(tmpPath_, packBase + ".pack");
+  finished_ = true;
+
+  std::vector<PackIndexEntry> index;
+  index.reserve(entries_.size());
+  for (const auto &e : entries_)
+    index.push_back({e.sha, e.crc, e.offset});
+  writePackIndex(packBase + ".idx", std::move(index), checksum_);
+  return name;
+}
@@ -0,0 +1,90 @@
+#include "../../include/local_clone.h"
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+bool is_local_url(const std::string &url) {
+  if (url.rfind("file://", 0) == 0)
+    return true;
+  if (url.find("://") != std::string::npos)
+    return false;
+  std::error_code ec;
+  return url[0] == '/' || url.rfind("./", 0) == 0 ||
+         url.rfind("../", 0) == 0 || fs::is_directory(url, ec);
+}
+
+std::string local_repo_dir(const std::string &url) {
+  fs::path path = url.rfind("file://", 0) == 0 ? url.substr(7) : url;
+  std::error_code ec;
+  // A working tree, or the .verz directory itself
+  for (const fs::path &dir : {path / ".verz", path})
+    if (fs::is_regular_file(dir / "HEAD", ec) &&
+        fs::is_directory(dir / "objects", ec))
+      return fs::absolute(dir).lexically_normal().string();
+  throw std::runtime_error("repository '" + url + "' does not exist");
+}
+
+// Temporary and lock files belong to a writer in the source repository
+static bool is_transient(const fs::path &file) {
+  std::string name = file.filename().string();
+  return name.rfind("tmp_", 0) == 0 ||
+         (name.size() > 5 && name.compare(name.size() - 5, 5, ".lock") == 0);
+}
+
+size_t link_objects(const std::string &srcDir, const std::string &dstDir) {
+  fs::path src = fs::path(srcDir) / "objects";
+  fs::path dst = fs::path(dstDir) / "objects";
+  size_t linked = 0;
+  bool canLink = true;
+  for (const auto &de : fs::recursive_directory_iterator(src)) {
+    if (!de.is_regular_file() || is_transient(de.path()))
+      continue;
+    fs::path target = dst / fs::relative(de.path(), src);
+    if (fs::exists(target))
+      continue;
+    fs::create_directories(target.parent_path());
+
+    // Every file under objects/ is replaced by rename, never rewritten in
+    // place, so both repositories can share the inode. Links fail across
+    // filesystems; copy from then on.
+    std::error_code ec;
+    if (canLink)
+      fs::create_hard_link(de.path(), target, ec);
+    if (!canLink || ec) {
+      canLink = false;
+      fs::copy_file(de.path(), target);
+    }
+    linked++;
+  }
+  return linked;
+}
+
+std::map<std::string, std::string> local_branches(const std::string &dir) {
+  std::map<std::string, std::string> branches;
+  fs::path heads = fs::path(dir) / "refs" / "heads";
+  if (!fs::exists(heads))
+    return branches;
+  for (const auto &de : fs::recursive_directory_iterator(heads)) {
+    if (!de.is_regular_file() || is_transient(de.path()))
+      continue;
+    std::ifstream f(de.path());
+    std::string sha;
+    std::getline(f, sha);
+    if (sha.size() >= 40)
+      branches[fs::relative(de.path(), heads).generic_string()] =
+          sha.substr(0, 40);
+  }
+  return branches;
+}
+
+std::string local_head_branch(const std::string &dir) {
+  std::ifstream f(fs::path(dir) / "HEAD");
+  std::string line;
+  std::getline(f, line);
+  const std::string prefix = "ref: refs/heads/";
+  if (line.rfind(prefix, 0) != 0)
+    throw std::runtime_error("source repository has a detached HEAD");
+  return line.substr(prefix.size());
+}
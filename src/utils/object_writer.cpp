@@ -0,0 +1,121 @@
+#include "../../include/object_writer.h"
+#include "../../include/object_id.h"
+#include "../../include/utils.h"
+#include <atomic>
+#include <filesystem>
+#include <stdexcept>
+#include <unistd.h>
+
+// Compressed output kept in memory before it goes to a temporary file
+static const size_t SPILL_THRESHOLD = 1024 * 1024;
+static const size_t DEFLATE_CHUNK = 16 * 1024;
+
+// A private name under .verz/objects, unique across threads and processes
+static std::string tmpObjectPath() {
+  static std::atomic<unsigned> counter{0};
+  return ".verz/objects/tmp_obj_" + std::to_string(getpid()) + "_" +
+         std::to_string(counter++);
+}
+
+ObjectWriter::ObjectWriter(const std::string &type, uint64_t size, bool write)
+    : write_(write), size_(size) {
+  hash_ = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(hash_, EVP_sha1(), nullptr);
+  if (write_ && deflateInit(&zs_, Z_DEFAULT_COMPRESSION) != Z_OK)
+    throw std::runtime_error("deflateInit failed");
+
+  std::string header = type + " " + std::to_string(size);
+  header += '\0';
+  EVP_DigestUpdate(hash_, header.data(), header.size());
+  if (write_)
+    compress(header.data(), header.size(), Z_NO_FLUSH);
+}
+
+ObjectWriter::~ObjectWriter() {
+  if (write_)
+    deflateEnd(&zs_);
+  EVP_MD_CTX_free(hash_);
+  if (!tmpPath_.empty()) {
+    tmp_.close();
+    std::error_code ec;
+    std::filesystem::remove(tmpPath_, ec);
+  }
+}
+
+void ObjectWriter::compress(const void *data, size_t len, int flush) {
+  zs_.next_in = static_cast<Bytef *>(const_cast<void *>(data));
+  zs_.avail_in = static_cast<uInt>(len);
+  char buffer[DEFLATE_CHUNK];
+  int ret;
+  do {
+    zs_.next_out = reinterpret_cast<Bytef *>(buffer);
+    zs_.avail_out = sizeof(buffer);
+    ret = deflate(&zs_, flush);
+    if (ret == Z_STREAM_ERROR)
+      throw std::runtime_error("deflate failed");
+    pending_.append(buffer, sizeof(buffer) - zs_.avail_out);
+  } while (zs_.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+  if (pending_.size() >= SPILL_THRESHOLD)
+    spill();
+}
+
+void ObjectWriter::spill() {
+  if (tmpPath_.empty()) {
+    tmpPath_ = tmpObjectPath();
+    tmp_.open(tmpPath_, std::ios::binary | std::ios::trunc);
+    if (!tmp_)
+      throw std::runtime_error("Cannot write " + tmpPath_);
+  }
+  tmp_.write(pending_.data(), pending_.size());
+  pending_.clear();
+}
+
+void ObjectWriter::update(const void *data, size_t len) {
+  if (finished_)
+    throw std::logic_error("ObjectWriter::update after finish");
+  received_ += len;
+  if (received_ > size_)
+    throw std::runtime_error("Object content exceeds its declared size");
+
+  // zlib counts input in uInt, so very large chunks go in slices
+  const char *p = static_cast<const char *>(data);
+  while (len > 0) {
+    size_t n = std::min<size_t>(len, 1u << 30);
+    EVP_DigestUpdate(hash_, p, n);
+    if (write_)
+      compress(p, n, Z_NO_FLUSH);
+    p += n;
+    len -= n;
+  }
+}
+
+ObjectId ObjectWriter::finish_id() {
+  if (finished_)
+    throw std::logic_error("ObjectWriter::finish called twice");
+  finished_ = true;
+  if (received_ != size_)
+    throw std::runtime_error("Object content is shorter than its declared "
+                             "size");
+
+  unsigned char digest[20];
+  EVP_DigestFinal_ex(hash_, digest, nullptr);
+  ObjectId id = ObjectId::from_raw(digest);
+  if (!write_ || objectExists(id))
+    return id; // the destructor discards any spilled bytes
+
+  compress(nullptr, 0, Z_FINISH);
+  spill();
+  tmp_.close();
+  if (!tmp_)
+    throw std::runtime_error("Cannot write " + tmpPath_);
+
+  // Renaming makes the write atomic, so concurrent writers of the same
+  // object never observe (or produce) a half-written file
+  std::string path = getObjectPath(id);
+  std::filesystem::create_directories(
+      std::filesystem::path(path).parent_path());
+  std::filesystem::rename(tmpPath_, path);
+  tmpPath_.clear();
+  return id;
+}
@@ -0,0 +1,846 @@
+#include "../../include/pack.h"
+#include "../../include/utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <openssl/sha.h>
+#include <shared_mutex>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <zlib.h>
+
+// ---------------------------------------------------------------------------
+// Shared helpers
+// ---------------------------------------------------------------------------
+
+static uint32_t get_be32(const uint8_t *b) {
+  return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) |
+         (uint32_t(b[2]) << 8) | (uint32_t(b[3]));
+}
+
+static void put_be32(std::string &out, uint32_t v) {
+  out.push_back(static_cast<char>(v >> 24));
+  out.push_back(static_cast<char>(v >> 16));
+  out.push_back(static_cast<char>(v >> 8));
+  out.push_back(static_cast<char>(v));
+}
+
+std::string packTypeName(uint8_t type) {
+  switch (type) {
+  case PACK_COMMIT:
+    return "commit";
+  case PACK_TREE:
+    return "tree";
+  case PACK_BLOB:
+    return "blob";
+  case PACK_TAG:
+    return "tag";
+  default:
+    throw std::runtime_error("Unknown object type");
+  }
+}
+
+uint8_t packTypeCode(const std::string &name) {
+  if (name == "commit")
+    return PACK_COMMIT;
+  if (name == "tree")
+    return PACK_TREE;
+  if (name == "blob")
+    return PACK_BLOB;
+  if (name == "tag")
+    return PACK_TAG;
+  throw std::runtime_error("Unknown object type: " + name);
+}
+
+// Deltas come from remote packs, so every read is checked against the
+// instruction stream and every copy against the base and the result
+std::vector<unsigned char>
+resolveDelta(const std::vector<unsigned char> &base,
+             const std::vector<unsigned char> &delta) {
+  size_t deltaOffset = 0;
+  auto next = [&]() -> uint8_t {
+    if (deltaOffset >= delta.size())
+      throw std::runtime_error("Corrupt delta");
+    return delta[deltaOffset++];
+  };
+  auto varint = [&]() {
+    uint64_t value = 0;
+    uint8_t b;
+    int shift = 0;
+    do {
+      if (shift > 63)
+        throw std::runtime_error("Corrupt delta");
+      b = next();
+      value |= uint64_t(b & 0x7F) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    return value;
+  };
+
+  uint64_t sourceSize = varint(); // size of the base object that delta expects
+  uint64_t targetSize = varint(); // size of the object after resolving delta
+
+  if (sourceSize != base.size()) {
+    throw std::runtime_error("Base size mismatch: expected " +
+                             std::to_string(sourceSize) + ", actual " +
+                             std::to_string(base.size()));
+  }
+
+  std::vector<unsigned char> result(targetSize);
+  size_t resultOffset = 0;
+
+  while (deltaOffset < delta.size()) {
+    uint8_t opcode = delta[deltaOffset++];
+    if (opcode & 0x80) {
+      uint64_t copyOffset = 0, copySize = 0;
+      if (opcode & 0x01)
+        copyOffset |= uint64_t(next());
+      if (opcode & 0x02)
+        copyOffset |= uint64_t(next()) << 8;
+      if (opcode & 0x04)
+        copyOffset |= uint64_t(next()) << 16;
+      if (opcode & 0x08)
+        copyOffset |= uint64_t(next()) << 24;
+      if (opcode & 0x10)
+        copySize |= uint64_t(next());
+      if (opcode & 0x20)
+        copySize |= uint64_t(next()) << 8;
+      if (opcode & 0x40)
+        copySize |= uint64_t(next()) << 16;
+      if (copySize == 0)
+        copySize = 0x10000;
+      if (copyOffset + copySize > base.size() ||
+          copySize > result.size() - resultOffset)
+        throw std::runtime_error("Corrupt delta");
+      std::memcpy(result.data() + resultOffset, base.data() + copyOffset,
+                  copySize);
+      resultOffset += copySize;
+    } else {
+      uint64_t insertSize = opcode & 0x7F;
+      if (insertSize == 0 || insertSize > delta.size() - deltaOffset ||
+          insertSize > result.size() - resultOffset)
+        throw std::runtime_error("Corrupt delta");
+      std::memcpy(result.data() + resultOffset, delta.data() + deltaOffset,
+                  insertSize);
+      resultOffset += insertSize;
+      deltaOffset += insertSize;
+    }
+  }
+
+  if (resultOffset != result.size())
+    throw std::runtime_error("Corrupt delta");
+  return result;
+}
+
+// ---------------------------------------------------------------------------
+// Delta encoder
+// ---------------------------------------------------------------------------
+
+static const size_t DELTA_BLOCK = 16;
+static const size_t DELTA_MAX_COPY = 0x10000;
+
+static uint32_t blockHash(const unsigned char *p) {
+  uint64_t a, b;
+  std::memcpy(&a, p, 8);
+  std::memcpy(&b, p + 8, 8);
+  uint64_t h = a * 0x9E3779B97F4A7C15ull ^ (b + (a >> 29)) * 0xC2B2AE3D27D4EB4Full;
+  return static_cast<uint32_t>(h >> 32) ^ static_cast<uint32_t>(h);
+}
+
+static void putDeltaSize(std::string &out, uint64_t size) {
+  do {
+    uint8_t b = size & 0x7F;
+    size >>= 7;
+    out.push_back(static_cast<char>(size ? (b | 0x80) : b));
+  } while (size);
+}
+
+static void putInsert(std::string &out, const unsigned char *data, size_t len) {
+  while (len > 0) {
+    size_t n = std::min<size_t>(len, 0x7F);
+    out.push_back(static_cast<char>(n));
+    out.append(reinterpret_cast<const char *>(data), n);
+    data += n;
+    len -= n;
+  }
+}
+
+static void putCopy(std::string &out, uint64_t offset, uint64_t size) {
+  while (size > 0) {
+    uint64_t n = std::min<uint64_t>(size, DELTA_MAX_COPY);
+    char args[7];
+    int nargs = 0;
+    uint8_t opcode = 0x80;
+    for (int i = 0; i < 4; i++) {
+      uint8_t b = (offset >> (8 * i)) & 0xFF;
+      if (b) {
+        opcode |= 1 << i;
+        args[nargs++] = static_cast<char>(b);
+      }
+    }
+    for (int i = 0; i < 3; i++) {
+      uint8_t b = (n >> (8 * i)) & 0xFF;
+      if (b) {
+        opcode |= 0x10 << i;
+        args[nargs++] = static_cast<char>(b);
+      }
+    }
+    out.push_back(static_cast<char>(opcode));
+    out.append(args, nargs);
+    offset += n;
+    size -= n;
+  }
+}
+
+std::string createDelta(const std::string &base, const std::string &target,
+                        size_t maxSize) {
+  const unsigned char *src = reinterpret_cast<const unsigned char *>(base.data());
+  const unsigned char *trg =
+      reinterpret_cast<const unsigned char *>(target.data());
+  if (base.size() < DELTA_BLOCK || base.size() > 0xFFFFFFFFu)
+    return "";
+
+  // Index every aligned block of the base; first occurrence wins
+  size_t blocks = base.size() / DELTA_BLOCK;
+  size_t tableSize = 16;
+  while (tableSize < blocks * 2)
+    tableSize <<= 1;
+  std::vector<uint32_t> table(tableSize, UINT32_MAX);
+  for (size_t off = 0; off + DELTA_BLOCK <= base.size(); off += DELTA_BLOCK) {
+    uint32_t &slot = table[blockHash(src + off) & (tableSize - 1)];
+    if (slot == UINT32_MAX)
+      slot = static_cast<uint32_t>(off);
+  }
+
+  std::string out;
+  putDeltaSize(out, base.size());
+  putDeltaSize(out, target.size());
+
+  size_t pos = 0, insertStart = 0;
+  while (pos + DELTA_BLOCK <= target.size()) {
+    uint32_t cand = table[blockHash(trg + pos) & (tableSize - 1)];
+    if (cand == UINT32_MAX ||
+        std::memcmp(src + cand, trg + pos, DELTA_BLOCK) != 0) {
+      pos++;
+      continue;
+    }
+
+    size_t srcPos = cand, len = DELTA_BLOCK;
+    while (srcPos + len < base.size() && pos + len < target.size() &&
+           src[srcPos + len] == trg[pos + len])
+      len++;
+    // Pull the match back over literals that also match
+    while (pos > insertStart && srcPos > 0 && src[srcPos - 1] == trg[pos - 1]) {
+      pos--;
+      srcPos--;
+      len++;
+    }
+
+    putInsert(out, trg + insertStart, pos - insertStart);
+    putCopy(out, srcPos, len);
+    pos += len;
+    insertStart = pos;
+    if (out.size() > maxSize)
+      return "";
+  }
+  putInsert(out, trg + insertStart, target.size() - insertStart);
+
+  if (out.size() > maxSize)
+    return "";
+  return out;
+}
+
+// ---------------------------------------------------------------------------
+// Index writer
+// ---------------------------------------------------------------------------
+
+std::string packDirectory() { return ".verz/objects/pack"; }
+
+std::string packTempPath(const std::string &kind) {
+  static std::atomic<unsigned> counter{0};
+  return packDirectory() + "/tmp_" + kind + "_" + std::to_string(getpid()) +
+         "_" + std::to_string(counter++);
+}
+
+// Bumped whenever this process installs a pack, so a pack added within the
+// directory's mtime granularity is still found
+static std::atomic<uint64_t> packGeneration{0};
+
+void writePackIndex(const std::string &idxPath,
+                    std::vector<PackIndexEntry> entries,
+                    const std::string &packChecksum) {
+  std::sort(entries.begin(), entries.end(),
+            [](const PackIndexEntry &a, const PackIndexEntry &b) {
+              return a.sha < b.sha;
+            });
+
+  std::string out = "\377tOc";
+  put_be32(out, 2);
+
+  // fanout[i] = number of objects whose first byte is <= i
+  uint32_t fanout[256] = {0};
+  for (const auto &e : entries)
+    fanout[e.sha.bytes[0]]++;
+  uint32_t running = 0;
+  for (int i = 0; i < 256; i++) {
+    running += fanout[i];
+    put_be32(out, running);
+  }
+
+  for (const auto &e : entries)
+    out += e.sha.raw();
+  for (const auto &e : entries)
+    put_be32(out, e.crc32);
+
+  // Offsets past 2^31 go to a trailing 64-bit table
+  std::vector<uint64_t> largeOffsets;
+  for (const auto &e : entries) {
+    if (e.offset < 0x80000000ull) {
+      put_be32(out, static_cast<uint32_t>(e.offset));
+    } else {
+      put_be32(out, 0x80000000u | static_cast<uint32_t>(largeOffsets.size()));
+      largeOffsets.push_back(e.offset);
+    }
+  }
+  for (uint64_t off : largeOffsets) {
+    put_be32(out, static_cast<uint32_t>(off >> 32));
+    put_be32(out, static_cast<uint32_t>(off));
+  }
+
+  out += packChecksum;
+  unsigned char idxChecksum[20];
+  SHA1(reinterpret_cast<const unsigned char *>(out.data()), out.size(),
+       idxChecksum);
+  out.append(reinterpret_cast<const char *>(idxChecksum), 20);
+
+  // Write under a temporary name so readers never see a partial index
+  std::string tmpPath = packTempPath("idx");
+  std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+  if (!f)
+    throw std::runtime_error("Cannot write pack index: " + idxPath);
+  f.write(out.data(), out.size());
+  f.close();
+  std::filesystem::rename(tmpPath, idxPath);
+  packGeneration++; // the pack is complete once its index is in place
+}
+
+// ---------------------------------------------------------------------------
+// Packed object reader
+// ---------------------------------------------------------------------------
+
+// Both files of a pack are mapped read-only for the life of the process
+struct PackFile {
+  std::string packPath;
+  const uint8_t *idx = nullptr;
+  size_t idxSize = 0;
+  const uint8_t *pack = nullptr;
+  size_t packSize = 0;
+  uint32_t count = 0;
+  size_t largeCount = 0; // rows of the 64-bit offset table
+
+  ~PackFile() {
+    if (idx)
+      munmap(const_cast<uint8_t *>(idx), idxSize);
+    if (pack)
+      munmap(const_cast<uint8_t *>(pack), packSize);
+  }
+};
+
+static const uint8_t *mapFile(const std::string &path, size_t &size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Failed to open file: " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    throw std::runtime_error("Failed to stat file: " + path);
+  }
+  size = static_cast<size_t>(st.st_size);
+  void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    throw std::runtime_error("Failed to map file: " + path);
+  return static_cast<const uint8_t *>(p);
+}
+
+// Lookups share the lock; only a rescan takes it exclusively
+static std::shared_mutex packsMutex;
+
+// What the pack directory looked like at the last scan
+struct PackDirStamp {
+  bool exists = false;
+  std::filesystem::file_time_type mtime;
+  uint64_t generation = 0;
+  bool operator==(const PackDirStamp &o) const {
+    return exists == o.exists && mtime == o.mtime &&
+           generation == o.generation;
+  }
+};
+
+static PackDirStamp currentPackDirStamp() {
+  PackDirStamp stamp;
+  stamp.generation = packGeneration.load();
+  std::error_code ec;
+  stamp.mtime = std::filesystem::last_write_time(packDirectory(), ec);
+  stamp.exists = !ec;
+  return stamp;
+}
+
+static std::vector<std::unique_ptr<PackFile>> &loadedPacks() {
+  static std::vector<std::unique_ptr<PackFile>> packs;
+  return packs;
+}
+
+// Maps any .idx files not seen yet; returns true if something new appeared.
+// Caller holds packsMutex exclusively.
+static bool scanPacks() {
+  auto &packs = loadedPacks();
+  if (!std::filesystem::is_directory(packDirectory()))
+    return false;
+
+  bool added = false;
+  for (const auto &de : std::filesystem::directory_iterator(packDirectory())) {
+    if (de.path().extension() != ".idx")
+      continue;
+    std::filesystem::path packPath = de.path();
+    packPath.replace_extension(".pack");
+    if (!std::filesystem::exists(packPath))
+      continue;
+    bool known = std::any_of(packs.begin(), packs.end(), [&](const auto &p) {
+      return p->packPath == packPath.string();
+    });
+    if (known)
+      continue;
+
+    auto pack = std::make_unique<PackFile>();
+    pack->packPath = packPath.string();
+    pack->idx = mapFile(de.path().string(), pack->idxSize);
+    if (pack->idxSize < 8 + 1024 + 40 ||
+        std::memcmp(pack->idx, "\377tOc", 4) != 0 ||
+        get_be32(pack->idx + 4) != 2)
+      throw std::runtime_error("Unsupported pack index: " +
+                               de.path().string());
+    // Lookups trust the fanout and count, so both are checked against the
+    // file: names, CRCs and offsets (28 bytes per object) and the two
+    // trailing checksums must fit, and any rest is 64-bit offsets
+    uint32_t prev = 0;
+    for (int i = 0; i < 256; i++) {
+      uint32_t n = get_be32(pack->idx + 8 + i * 4);
+      if (n < prev)
+        throw std::runtime_error("Non-monotonic pack index: " +
+                                 de.path().string());
+      prev = n;
+    }
+    pack->count = prev;
+    size_t tables = 8 + 1024 + size_t(pack->count) * 28 + 40;
+    if (pack->idxSize < tables)
+      throw std::runtime_error("Truncated pack index: " + de.path().string());
+    pack->largeCount = (pack->idxSize - tables) / 8;
+    pack->pack = mapFile(pack->packPath, pack->packSize);
+    if (pack->packSize < 32 || std::memcmp(pack->pack, "PACK", 4) != 0)
+      throw std::runtime_error("Invalid pack: " + pack->packPath);
+    packs.push_back(std::move(pack));
+    added = true;
+  }
+  return added;
+}
+
+static bool findInPack(const PackFile &pack, const unsigned char *sha,
+                       uint64_t &offset) {
+  const uint8_t *fanout = pack.idx + 8;
+  const uint8_t *names = fanout + 1024;
+  uint32_t lo = sha[0] == 0 ? 0 : get_be32(fanout + (sha[0] - 1) * 4);
+  uint32_t hi = get_be32(fanout + sha[0] * 4);
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp = std::memcmp(names + size_t(mid) * 20, sha, 20);
+    if (cmp == 0) {
+      const uint8_t *offsets = names + size_t(pack.count) * 24;
+      uint32_t off = get_be32(offsets + size_t(mid) * 4);
+      if (off & 0x80000000u) {
+        if ((off & 0x7FFFFFFFu) >= pack.largeCount)
+          throw std::runtime_error("Corrupt pack index for " + pack.packPath);
+        const uint8_t *large = offsets + size_t(pack.count) * 4 +
+                               size_t(off & 0x7FFFFFFFu) * 8;
+        offset = (uint64_t(get_be32(large)) << 32) | get_be32(large + 4);
+      } else {
+        offset = off;
+      }
+      return true;
+    }
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return false;
+}
+
+// Finds the pack holding `hash`. A miss rescans the pack directory only if
+// it changed since the last scan, so the misses of every newly written
+// object (ObjectWriter checks for an existing copy) cost one stat and
+// never serialize parallel writers on a directory walk.
+static const PackFile *locatePacked(const ObjectId &id, uint64_t &offset) {
+  const unsigned char *key = id.bytes.data();
+
+  {
+    std::shared_lock<std::shared_mutex> lock(packsMutex);
+    for (const auto &pack : loadedPacks())
+      if (findInPack(*pack, key, offset))
+        return pack.get();
+  }
+
+  static PackDirStamp scanned; // guarded by packsMutex
+  static bool everScanned = false;
+  PackDirStamp now = currentPackDirStamp();
+  std::unique_lock<std::shared_mutex> lock(packsMutex);
+  while (true) {
+    // Another thread may have scanned while we waited for the lock
+    for (const auto &pack : loadedPacks())
+      if (findInPack(*pack, key, offset))
+        return pack.get();
+    if (everScanned && now == scanned)
+      return nullptr;
+    scanned = now;
+    everScanned = true;
+    if (!scanPacks())
+      return nullptr;
+  }
+}
+
+// Size-bounded LRU of delta bases, keyed by (pack, offset). Entries are
+// shared so a reader keeps its base alive even if it is evicted meanwhile.
+struct DeltaBase {
+  uint8_t type;
+  std::shared_ptr<const std::vector<unsigned char>> data;
+};
+
+static const size_t DELTA_BASE_CACHE_LIMIT = 96 * 1024 * 1024;
+
+class DeltaBaseCache {
+public:
+  bool get(const PackFile *pack, uint64_t offset, DeltaBase &out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = map_.find({pack, offset});
+    if (it == map_.end())
+      return false;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    out = it->second->base;
+    return true;
+  }
+
+  void put(const PackFile *pack, uint64_t offset, const DeltaBase &base) {
+    size_t size = base.data->size();
+    if (size > DELTA_BASE_CACHE_LIMIT / 4)
+      return; // one huge blob should not flush everything else
+    std::lock_guard<std::mutex> lock(mutex_);
+    Key key{pack, offset};
+    if (map_.count(key))
+      return;
+    lru_.push_front({key, base});
+    map_[key] = lru_.begin();
+    bytes_ += size;
+    while (bytes_ > DELTA_BASE_CACHE_LIMIT && !lru_.empty()) {
+      bytes_ -= lru_.back().base.data->size();
+      map_.erase(lru_.back().key);
+      lru_.pop_back();
+    }
+  }
+
+private:
+  struct Key {
+    const PackFile *pack;
+    uint64_t offset;
+    bool operator==(const Key &o) const {
+      return pack == o.pack && offset == o.offset;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &k) const {
+      return std::hash<uint64_t>()(k.offset) ^
+             std::hash<const void *>()(k.pack);
+    }
+  };
+  struct Entry {
+    Key key;
+    DeltaBase base;
+  };
+
+  std::mutex mutex_;
+  std::list<Entry> lru_;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> map_;
+  size_t bytes_ = 0;
+};
+
+static DeltaBaseCache &deltaBaseCache() {
+  static DeltaBaseCache cache;
+  return cache;
+}
+
+bool inflatePackData(const uint8_t *data, size_t avail, uint64_t size,
+                     std::vector<unsigned char> &out) {
+  z_stream &stream = reusableInflater();
+  out.resize(size);
+  unsigned char empty;
+  stream.next_in = const_cast<Bytef *>(data);
+  stream.avail_in = static_cast<uInt>(
+      std::min<size_t>(avail, std::numeric_limits<uInt>::max()));
+  stream.next_out = out.empty() ? &empty : out.data();
+  stream.avail_out = static_cast<uInt>(out.size());
+
+  // The output size is known up front, so one call inflates the whole entry
+  int ret = inflate(&stream, Z_FINISH);
+  return ret == Z_STREAM_END && stream.total_out == size;
+}
+
+static std::vector<unsigned char> inflateAt(const PackFile &pack, size_t pos,
+                                            uint64_t expectedSize) {
+  std::vector<unsigned char> out;
+  if (!inflatePackData(pack.pack + pos, pack.packSize - pos, expectedSize,
+                       out))
+    throw std::runtime_error("Corrupt packed object in " + pack.packPath);
+  return out;
+}
+
+// Parsed pack entry header; `dataPos` is where the zlib stream starts
+struct EntryHeader {
+  uint8_t type;
+  uint64_t size;
+  size_t dataPos;
+  uint64_t baseOffset; // OFS_DELTA only
+  const uint8_t *baseSha; // REF_DELTA only
+};
+
+// Offsets come from the index and from OFS_DELTA headers, so every header
+// byte is checked against the end of the entries (the 20-byte trailer)
+static EntryHeader parseEntryHeader(const PackFile &pack, uint64_t offset) {
+  const uint8_t *p = pack.pack;
+  const size_t end = pack.packSize - 20;
+  size_t pos = offset;
+  auto corrupt = [&]() {
+    return std::runtime_error("Corrupt pack entry at offset " +
+                              std::to_string(offset) + " in " + pack.packPath);
+  };
+  if (offset < 12 || offset >= end)
+    throw std::runtime_error("Pack offset out of range");
+
+  EntryHeader h{};
+  uint8_t c = p[pos++];
+  h.type = (c >> 4) & 0x07;
+  h.size = c & 0x0F;
+  int shift = 4;
+  while (c & 0x80) {
+    if (pos >= end || shift > 63)
+      throw corrupt();
+    c = p[pos++];
+    h.size |= uint64_t(c & 0x7F) << shift;
+    shift += 7;
+  }
+
+  if (h.type == PACK_OFS_DELTA) {
+    uint64_t ofs = 0;
+    do {
+      if (pos >= end || ofs > (uint64_t(1) << 56))
+        throw corrupt();
+      c = p[pos++];
+      ofs = (ofs << 7) | (c & 0x7F);
+      if (c & 0x80)
+        ofs++;
+    } while (c & 0x80);
+    if (ofs == 0 || ofs > offset)
+      throw std::runtime_error("Bad OFS_DELTA base in " + pack.packPath);
+    h.baseOffset = offset - ofs;
+  } else if (h.type == PACK_REF_DELTA) {
+    if (end - pos < 20)
+      throw corrupt();
+    h.baseSha = p + pos;
+    pos += 20;
+  } else if (h.type < PACK_COMMIT || h.type > PACK_TAG) {
+    throw corrupt();
+  }
+  if (pos >= end)
+    throw corrupt();
+  h.dataPos = pos;
+  return h;
+}
+
+// Resolves the entry at `offset`, walking its delta chain down to the
+// nearest cached or undeltified base and then applying deltas back up.
+static void readPackEntry(const PackFile &pack, uint64_t offset, uint8_t &type,
+                          std::vector<unsigned char> &data) {
+  std::vector<EntryHeader> chain;
+  std::vector<uint64_t> chainOffsets;
+  DeltaBase base;
+  uint64_t cur = offset;
+
+  while (true) {
+    if (!chain.empty() && deltaBaseCache().get(&pack, cur, base))
+      break;
+
+    EntryHeader h = parseEntryHeader(pack, cur);
+    if (h.type == PACK_OFS_DELTA) {
+      chain.push_back(h);
+      chainOffsets.push_back(cur);
+      cur = h.baseOffset;
+      continue;
+    }
+    if (h.type == PACK_REF_DELTA) {
+      chain.push_back(h);
+      chainOffsets.push_back(cur);
+      // The base may live in another pack or as a loose object
+      std::string baseObject =
+          readGitObject(ObjectId::from_raw(h.baseSha));
+      size_t space = baseObject.find(' ');
+      size_t nul = baseObject.find('\0');
+      base.type = packTypeCode(baseObject.substr(0, space));
+      base.data = std::make_shared<const std::vector<unsigned char>>(
+          baseObject.begin() + nul + 1, baseObject.end());
+      break;
+    }
+
+    if (chain.empty()) {
+      type = h.type;
+      data = inflateAt(pack, h.dataPos, h.size);
+      return;
+    }
+    base.type = h.type;
+    base.data = std::make_shared<const std::vector<unsigned char>>(
+        inflateAt(pack, h.dataPos, h.size));
+    deltaBaseCache().put(&pack, cur, base);
+    break;
+  }
+
+  for (size_t i = chain.size(); i-- > 0;) {
+    std::vector<unsigned char> delta =
+        inflateAt(pack, chain[i].dataPos, chain[i].size);
+    std::vector<unsigned char> result = resolveDelta(*base.data, delta);
+    if (i == 0) {
+      type = base.type;
+      data = std::move(result);
+      return;
+    }
+    base.data =
+        std::make_shared<const std::vector<unsigned char>>(std::move(result));
+    deltaBaseCache().put(&pack, chainOffsets[i], base);
+  }
+}
+
+bool packedObjectExists(const ObjectId &id) {
+  uint64_t offset;
+  return locatePacked(id, offset) != nullptr;
+}
+
+bool packedObjectExists(const std::string &hash) {
+  ObjectId id;
+  return ObjectId::parse_hex(hash, id) && packedObjectExists(id);
+}
+
+bool packedObjectOffset(const ObjectId &id, std::string &packPath,
+                        uint64_t &offset) {
+  const PackFile *pack = locatePacked(id, offset);
+  if (!pack)
+    return false;
+  packPath = pack->packPath;
+  return true;
+}
+
+bool packedObjectOffset(const std::string &hash, std::string &packPath,
+                        uint64_t &offset) {
+  ObjectId id;
+  return ObjectId::parse_hex(hash, id) &&
+         packedObjectOffset(id, packPath, offset);
+}
+
+// Inflates only the first bytes of a delta, enough for its two size
+// varints, and returns the size of the object it produces
+static uint64_t deltaResultSize(const PackFile &pack, const EntryHeader &h) {
+  unsigned char buf[20]; // two varints of at most 10 bytes each
+  z_stream &stream = reusableInflater();
+  stream.next_in = const_cast<Bytef *>(pack.pack + h.dataPos);
+  stream.avail_in = static_cast<uInt>(std::min<size_t>(
+      pack.packSize - h.dataPos, std::numeric_limits<uInt>::max()));
+  stream.next_out = buf;
+  stream.avail_out = static_cast<uInt>(std::min<uint64_t>(sizeof(buf), h.size));
+  int ret = inflate(&stream, Z_SYNC_FLUSH);
+  if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+    throw std::runtime_error("Corrupt packed object in " + pack.packPath);
+  size_t got = stream.next_out - buf;
+
+  size_t pos = 0;
+  uint64_t size = 0;
+  for (int varint = 0; varint < 2; varint++) {
+    size = 0;
+    int shift = 0;
+    uint8_t b;
+    do {
+      if (pos == got || shift > 63)
+        throw std::runtime_error("Corrupt packed object in " + pack.packPath);
+      b = buf[pos++];
+      size |= uint64_t(b & 0x7F) << shift;
+      shift += 7;
+    } while (b & 0x80);
+  }
+  return size;
+}
+
+bool packedObjectInfo(const ObjectId &id, uint8_t &type, uint64_t &size) {
+  uint64_t offset;
+  const PackFile *pack = locatePacked(id, offset);
+  if (!pack)
+    return false;
+
+  EntryHeader h = parseEntryHeader(*pack, offset);
+  size = h.type == PACK_OFS_DELTA || h.type == PACK_REF_DELTA
+             ? deltaResultSize(*pack, h)
+             : h.size;
+  // A delta has the type of the object at the end of its chain
+  while (h.type == PACK_OFS_DELTA)
+    h = parseEntryHeader(*pack, h.baseOffset);
+  if (h.type == PACK_REF_DELTA) {
+    std::string baseType;
+    uint64_t baseSize;
+    ObjectId base = ObjectId::from_raw(h.baseSha);
+    if (!readObjectInfo(base, baseType, baseSize))
+      throw std::runtime_error("Missing delta base " + base.hex());
+    h.type = packTypeCode(baseType);
+  }
+  type = h.type;
+  return true;
+}
+
+bool packedObjectInfo(const std::string &hash, uint8_t &type,
+                      uint64_t &size) {
+  ObjectId id;
+  return ObjectId::parse_hex(hash, id) && packedObjectInfo(id, type, size);
+}
+
+bool readPackedObject(const ObjectId &id, std::string &object) {
+  uint64_t offset;
+  const PackFile *pack = locatePacked(id, offset);
+  if (!pack)
+    return false;
+
+  uint8_t type = 0;
+  std::vector<unsigned char> data;
+  readPackEntry(*pack, offset, type, data);
+  object = packTypeName(type) + " " + std::to_string(data.size());
+  object += '\0';
+  object.append(data.begin(), data.end());
+  return true;
+}
+
+bool readPackedObject(const std::string &hash, std::string &object) {
+  ObjectId id;
+  return ObjectId::parse_hex(hash, id) && readPackedObject(id, object);
+}
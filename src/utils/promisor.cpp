@@ -0,0 +1,74 @@
+#include "../../include/promisor.h"
+#include "../../include/clone.h"
+#include "../../include/index_pack.h"
+#include "../../include/pack.h"
+#include "../../include/remote.h"
+#include "../../include/utils.h"
+#include <mutex>
+#include <set>
+
+static bool promisor_remote(Remote &remote) {
+  return read_remote("origin", remote) && remote.promisor &&
+         !remote.url.empty();
+}
+
+bool has_promisor_remote() {
+  Remote remote;
+  return promisor_remote(remote);
+}
+
+void mark_promisor_pack(const std::string &packName) {
+  std::ofstream(packDirectory() + "/pack-" + packName + ".promisor");
+}
+
+bool fetch_promised_objects(const std::vector<ObjectId> &ids) {
+  Remote remote;
+  if (!promisor_remote(remote))
+    return false;
+
+  // One download at a time; a concurrent caller may already have brought
+  // in what this one needs
+  static std::mutex fetchMutex;
+  std::unique_lock<std::mutex> lock(fetchMutex);
+
+  std::set<ObjectId> missing;
+  for (const auto &id : ids)
+    if (!objectExists(id))
+      missing.insert(id);
+  if (missing.empty())
+    return true;
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  CURL *curl = curl_easy_init();
+  std::unique_ptr<CURL, void (*)(CURL *)> guard(curl, [](CURL *c) {
+    curl_easy_cleanup(c);
+    curl_global_cleanup();
+  });
+  try {
+    // v2 lets us want any object; v0 servers must allow it explicitly
+    std::vector<uint8_t> advertisement = discoverRefs(curl, remote.url);
+    bool v2 = isProtocolV2(advertisement);
+
+    // Explicitly wanted objects are always sent; the filter keeps wanted
+    // trees from dragging in their blobs
+    std::vector<std::string> wants;
+    for (const auto &id : missing)
+      wants.push_back(id.hex());
+    std::string request =
+        makeFetchRequest(v2, wants, 0, remote.partialCloneFilter);
+
+    PackIndexer indexer;
+    std::set<ObjectId> shallow;
+    makeRequest(curl, request, remote.url, indexer, shallow, v2);
+    // Resolving a thin delta inside finish() may read a base that is itself
+    // promised, fetching it from this thread or a pool worker, so the lock
+    // must not be held there. At worst a concurrent caller fetches the same
+    // objects again.
+    lock.unlock();
+    mark_promisor_pack(indexer.finish());
+  } catch (const std::exception &e) {
+    throw std::runtime_error("could not fetch " + missing.begin()->hex() +
+                             " from promisor remote: " + e.what());
+  }
+  return true;
+}
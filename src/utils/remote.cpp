@@ -0,0 +1,99 @@
+#include "../../include/remote.h"
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+// Only the subset of Git's config syntax that verz writes is understood:
+//   [remote "origin"]
+//   	url = https://example.com/repo.git
+//   	promisor = true
+//   	partialclonefilter = blob:none
+
+std::string configPath() { return ".verz/config"; }
+
+static std::string trim(const std::string &s) {
+  size_t begin = s.find_first_not_of(" \t\r");
+  if (begin == std::string::npos)
+    return "";
+  size_t end = s.find_last_not_of(" \t\r");
+  return s.substr(begin, end - begin + 1);
+}
+
+static std::string section_header(const std::string &name) {
+  return "[remote \"" + name + "\"]";
+}
+
+bool read_remote(const std::string &name, Remote &remote) {
+  std::ifstream in(configPath());
+  if (!in)
+    return false;
+
+  std::string header = section_header(name);
+  bool inSection = false, found = false;
+  std::string line;
+  while (std::getline(in, line)) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#' || line[0] == ';')
+      continue;
+    if (line[0] == '[') {
+      inSection = line == header;
+      if (inSection) {
+        found = true;
+        remote = Remote{};
+        remote.name = name;
+      }
+      continue;
+    }
+    if (!inSection)
+      continue;
+
+    size_t eq = line.find('=');
+    std::string key = trim(line.substr(0, eq));
+    std::string value =
+        eq == std::string::npos ? "true" : trim(line.substr(eq + 1));
+    for (auto &c : key)
+      c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    if (key == "url")
+      remote.url = value;
+    else if (key == "promisor")
+      remote.promisor = value == "true" || value == "1" || value == "yes";
+    else if (key == "partialclonefilter")
+      remote.partialCloneFilter = value;
+  }
+  return found;
+}
+
+void write_remote(const Remote &remote) {
+  // Copy every line except the old section for this remote
+  std::vector<std::string> lines;
+  std::ifstream in(configPath());
+  std::string header = section_header(remote.name);
+  bool skipping = false;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::string t = trim(line);
+    if (!t.empty() && t[0] == '[')
+      skipping = t == header;
+    if (!skipping)
+      lines.push_back(line);
+  }
+  in.close();
+
+  lines.push_back(header);
+  lines.push_back("\turl = " + remote.url);
+  if (remote.promisor)
+    lines.push_back("\tpromisor = true");
+  if (!remote.partialCloneFilter.empty())
+    lines.push_back("\tpartialclonefilter = " + remote.partialCloneFilter);
+
+  std::string tmp = configPath() + ".lock";
+  std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+  for (const auto &l : lines)
+    out << l << "\n";
+  out.close();
+  if (!out)
+    throw std::runtime_error("Cannot write " + tmp);
+  std::filesystem::rename(tmp, configPath());
+}
@@ -0,0 +1,126 @@
+#include "../../include/thread_pool.h"
+#include <stdexcept>
+
+// Index of the pool queue owned by the current thread (external threads
+// have none)
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local size_t current_queue = 0;
+
+ThreadPool::ThreadPool(size_t threads) {
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  if (threads == 0)
+    threads = 1;
+
+  for (size_t i = 0; i < threads; i++)
+    queues_.push_back(std::make_unique<Queue>());
+  for (size_t i = 0; i < threads; i++)
+    threads_.emplace_back([this, i] { worker_loop(i); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &t : threads_)
+    t.join();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  size_t target = current_pool == this
+                      ? current_queue
+                      : next_queue_.fetch_add(1) % queues_.size();
+  unfinished_++;
+  // Count before publishing so a thief can never drive queued_ below zero
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues_[target]->mutex);
+    queues_[target]->tasks.push_back(std::move(task));
+  }
+  work_cv_.notify_one();
+}
+
+bool ThreadPool::try_run(size_t self) {
+  std::function<void()> task;
+
+  // Own queue: newest first, keeps recursive work cache-warm
+  {
+    std::lock_guard<std::mutex> lock(queues_[self]->mutex);
+    if (!queues_[self]->tasks.empty()) {
+      task = std::move(queues_[self]->tasks.back());
+      queues_[self]->tasks.pop_back();
+    }
+  }
+  // Otherwise steal the oldest task from a sibling
+  for (size_t i = 1; !task && i <= queues_.size(); i++) {
+    Queue &victim = *queues_[(self + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+    }
+  }
+  if (!task)
+    return false;
+
+  queued_--;
+  try {
+    task();
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_)
+      error_ = std::current_exception();
+  }
+  if (--unfinished_ == 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_cv_.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::worker_loop(size_t self) {
+  current_pool = this;
+  current_queue = self;
+  while (true) {
+    if (try_run(self))
+      continue;
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+    if (stop_ && queued_ == 0)
+      return;
+  }
+}
+
+void ThreadPool::wait() {
+  // The calling task is itself unfinished, so the count could never reach
+  // zero
+  if (current_pool == this)
+    throw std::logic_error("ThreadPool::wait called from one of its tasks");
+
+  // Tasks run here count as this pool's, so a nested wait() is caught too
+  struct Scope {
+    const ThreadPool *saved = current_pool;
+    Scope(const ThreadPool *pool) { current_pool = pool; }
+    ~Scope() { current_pool = saved; }
+  } scope(this);
+  current_queue = 0;
+  while (unfinished_ > 0) {
+    if (try_run(0))
+      continue;
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return unfinished_ == 0 || queued_ > 0; });
+  }
+
+  std::exception_ptr error;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::swap(error, error_);
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
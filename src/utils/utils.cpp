@@ -1,31 +1,259 @@
 #include "../../include/utils.h"
+#include "../../include/object_id.h"
+#include "../../include/object_writer.h"
+#include "../../include/pack.h"
+#include "../../include/promisor.h"
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
-#include <iomanip>
 #include <iostream>
 #include <openssl/sha.h>
-#include <sstream>
+#include <stdexcept>
 #include <vector>
 #include <zlib.h>
 
-std::string binaryToHex(const std::string &binary) {
-  const unsigned char *data =
-      reinterpret_cast<const unsigned char *>(binary.c_str());
-  std::stringstream ss;
-  for (size_t i = 0; i < binary.size(); i++) {
-    ss << std::hex << std::setw(2) << std::setfill('0')
-       << static_cast<int>(data[i]);
+// Files are hashed in pieces of this size, so memory use does not depend
+// on the file size
+static const size_t BLOB_READ_CHUNK = 64 * 1024;
+
+// ---------------------------------------------------------------------------
+// Hex conversion
+// ---------------------------------------------------------------------------
+//
+// Every object name printed, parsed or used as a path goes through here,
+// so both directions work from lookup tables. On x86 the bulk of the input
+// is converted 16 or 32 bytes at a time with SSSE3 or AVX2. The build
+// targets baseline x86-64, so the CPU is checked once at run time; the
+// scalar code handles the tail and other architectures.
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// Value of every hex digit character, 0xFF for everything else
+struct HexDecodeTable {
+  uint8_t value[256];
+  constexpr HexDecodeTable() : value() {
+    for (int i = 0; i < 256; i++)
+      value[i] = 0xFF;
+    for (int i = 0; i < 10; i++)
+      value['0' + i] = static_cast<uint8_t>(i);
+    for (int i = 0; i < 6; i++) {
+      value['a' + i] = static_cast<uint8_t>(10 + i);
+      value['A' + i] = static_cast<uint8_t>(10 + i);
+    }
+  }
+};
+static constexpr HexDecodeTable HEX_DECODE;
+
+static void hex_encode_scalar(const uint8_t *in, size_t n, char *out) {
+  for (size_t i = 0; i < n; i++) {
+    out[2 * i] = HEX_DIGITS[in[i] >> 4];
+    out[2 * i + 1] = HEX_DIGITS[in[i] & 0xF];
   }
-  return ss.str();
 }
 
-std::string hexToBinary(const std::string &hex) {
-  std::string binary;
-  for (size_t i = 0; i < hex.length(); i += 2) {
-    std::string byteString = hex.substr(i, 2);
-    char byte = static_cast<char>(std::stoi(byteString, nullptr, 16));
-    binary.push_back(byte);
+// Decodes 2 * n digits into n bytes; false if any is not a hex digit
+static bool hex_decode_scalar(const char *in, size_t n, uint8_t *out) {
+  uint8_t bad = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint8_t hi = HEX_DECODE.value[static_cast<uint8_t>(in[2 * i])];
+    uint8_t lo = HEX_DECODE.value[static_cast<uint8_t>(in[2 * i + 1])];
+    bad |= hi | lo;
+    out[i] = static_cast<uint8_t>((hi << 4) | (lo & 0xF));
   }
+  return !(bad & 0xF0);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define VERZ_HEX_X86 1
+#include <immintrin.h>
+
+enum class HexKernel { Scalar, SSSE3, AVX2 };
+
+static HexKernel hex_kernel() {
+  static const HexKernel kernel = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return HexKernel::AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+      return HexKernel::SSSE3;
+    return HexKernel::Scalar;
+  }();
+  return kernel;
+}
+
+// Each nibble indexes the 16 digit characters with a byte shuffle; the
+// high and low digits are then interleaved. Returns the bytes consumed.
+__attribute__((target("ssse3"))) static size_t
+hex_encode_ssse3(const uint8_t *in, size_t n, char *out) {
+  const __m128i digits =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(HEX_DIGITS));
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    __m128i hi =
+        _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, mask));
+    __m128i *dst = reinterpret_cast<__m128i *>(out + 2 * i);
+    _mm_storeu_si128(dst, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(dst + 1, _mm_unpackhi_epi8(hi, lo));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+hex_encode_avx2(const uint8_t *in, size_t n, char *out) {
+  const __m256i digits = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(HEX_DIGITS)));
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+    __m256i hi = _mm256_shuffle_epi8(
+        digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, mask));
+    // Unpacking works per 128-bit lane: a = bytes 0-7 | 16-23,
+    // b = bytes 8-15 | 24-31
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    __m256i *dst = reinterpret_cast<__m256i *>(out + 2 * i);
+    _mm256_storeu_si256(dst, _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  return i;
+}
+
+// Digit values of 16 characters; lanes that are not hex digits are set in
+// `bad`
+__attribute__((target("ssse3"))) static __m128i
+hex_values_ssse3(__m128i c, __m128i &bad) {
+  __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  __m128i letter =
+      _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  __m128i isDigit =
+      _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+  __m128i isLetter =
+      _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+  bad = _mm_or_si128(bad, _mm_andnot_si128(_mm_or_si128(isDigit, isLetter),
+                                           _mm_set1_epi8(-1)));
+  return _mm_or_si128(
+      _mm_and_si128(isDigit, digit),
+      _mm_and_si128(isLetter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+// Pairs of digit values become bytes through one multiply-add: 16 * high
+// + low. Returns the bytes produced.
+__attribute__((target("ssse3"))) static size_t
+hex_decode_ssse3(const char *in, size_t n, uint8_t *out, bool &ok) {
+  const __m128i weights = _mm_set1_epi16(0x0110); // 16, 1
+  __m128i bad = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i *src = reinterpret_cast<const __m128i *>(in + 2 * i);
+    __m128i a = hex_values_ssse3(_mm_loadu_si128(src), bad);
+    __m128i b = hex_values_ssse3(_mm_loadu_si128(src + 1), bad);
+    __m128i bytes = _mm_packus_epi16(_mm_maddubs_epi16(a, weights),
+                                     _mm_maddubs_epi16(b, weights));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), bytes);
+  }
+  ok = _mm_movemask_epi8(bad) == 0;
+  return i;
+}
+
+__attribute__((target("avx2"))) static __m256i
+hex_values_avx2(__m256i c, __m256i &bad) {
+  __m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  __m256i letter = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)),
+                                   _mm256_set1_epi8('a'));
+  __m256i isDigit =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+  __m256i isLetter =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter);
+  bad = _mm256_or_si256(
+      bad, _mm256_andnot_si256(_mm256_or_si256(isDigit, isLetter),
+                               _mm256_set1_epi8(-1)));
+  __m256i letterValue = _mm256_add_epi8(letter, _mm256_set1_epi8(10));
+  return _mm256_or_si256(_mm256_and_si256(isDigit, digit),
+                         _mm256_and_si256(isLetter, letterValue));
+}
+
+__attribute__((target("avx2"))) static size_t
+hex_decode_avx2(const char *in, size_t n, uint8_t *out, bool &ok) {
+  const __m256i weights = _mm256_set1_epi16(0x0110);
+  __m256i bad = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i *src = reinterpret_cast<const __m256i *>(in + 2 * i);
+    __m256i a = hex_values_avx2(_mm256_loadu_si256(src), bad);
+    __m256i b = hex_values_avx2(_mm256_loadu_si256(src + 1), bad);
+    // packus interleaves the lanes of a and b; put the 8-byte groups back
+    // in order
+    __m256i bytes = _mm256_packus_epi16(_mm256_maddubs_epi16(a, weights),
+                                        _mm256_maddubs_epi16(b, weights));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                        _mm256_permute4x64_epi64(bytes, 0xD8));
+  }
+  ok = _mm256_movemask_epi8(bad) == 0;
+  return i;
+}
+#endif
+
+// The kernels are not inlined (they are compiled for another target), so
+// each is called only when the input fills at least one of its blocks. An
+// object name (20 bytes) takes one SSSE3 block and a scalar tail.
+void hexEncode(const uint8_t *in, size_t n, char *out) {
+  size_t done = 0;
+#ifdef VERZ_HEX_X86
+  HexKernel kernel = hex_kernel();
+  if (kernel == HexKernel::AVX2 && n >= 32)
+    done = hex_encode_avx2(in, n, out);
+  if (kernel != HexKernel::Scalar && n - done >= 16)
+    done += hex_encode_ssse3(in + done, n - done, out + 2 * done);
+#endif
+  hex_encode_scalar(in + done, n - done, out + 2 * done);
+}
+
+bool hexDecode(const char *in, size_t n, uint8_t *out) {
+  size_t done = 0;
+  bool ok = true;
+#ifdef VERZ_HEX_X86
+  HexKernel kernel = hex_kernel();
+  if (kernel == HexKernel::AVX2 && n >= 32)
+    done = hex_decode_avx2(in, n, out, ok);
+  if (ok && kernel != HexKernel::Scalar && n - done >= 16)
+    done += hex_decode_ssse3(in + 2 * done, n - done, out + done, ok);
+#endif
+  return ok && hex_decode_scalar(in + 2 * done, n - done, out + done);
+}
+
+std::string ObjectId::hex() const {
+  std::string out(HEX_SIZE, '\0');
+  hexEncode(bytes.data(), RAW_SIZE, &out[0]);
+  return out;
+}
+
+ObjectId ObjectId::from_hex(std::string_view hex) {
+  ObjectId id;
+  if (hex.size() != HEX_SIZE ||
+      !hexDecode(hex.data(), RAW_SIZE, id.bytes.data()))
+    throw std::invalid_argument("Not a valid object name " + std::string(hex));
+  return id;
+}
+
+std::string binaryToHex(const std::string &binary) {
+  std::string hex(binary.size() * 2, '\0');
+  hexEncode(reinterpret_cast<const uint8_t *>(binary.data()), binary.size(),
+            &hex[0]);
+  return hex;
+}
+
+std::string hexToBinary(const std::string &hex) {
+  std::string binary(hex.size() / 2, '\0');
+  if (hex.size() % 2 != 0 ||
+      !hexDecode(hex.data(), binary.size(),
+                 reinterpret_cast<uint8_t *>(&binary[0])))
+    throw std::invalid_argument("Invalid hex string: " + hex);
   return binary;
 }
 
@@ -52,109 +280,222 @@ std::string zlibCompress(const std::string &data) {
   return compressed;
 }
 
-std::string zlibDecompress(const std::string &compressed) {
+namespace {
+struct Inflater {
   z_stream stream{};
+  Inflater() {
+    if (inflateInit(&stream) != Z_OK)
+      throw std::runtime_error("inflateInit failed");
+  }
+  ~Inflater() { inflateEnd(&stream); }
+};
+} // namespace
+
+z_stream &reusableInflater() {
+  thread_local Inflater inflater;
+  if (inflateReset(&inflater.stream) != Z_OK)
+    throw std::runtime_error("inflateReset failed");
+  // inflateReset keeps the buffer pointers of the previous stream
+  inflater.stream.next_in = Z_NULL;
+  inflater.stream.avail_in = 0;
+  inflater.stream.next_out = Z_NULL;
+  inflater.stream.avail_out = 0;
+  return inflater.stream;
+}
+
+std::string zlibDecompress(const std::string &compressed) {
+  z_stream &stream = reusableInflater();
   stream.next_in =
       reinterpret_cast<Bytef *>(const_cast<char *>(compressed.data()));
   stream.avail_in = compressed.size();
 
-  if (inflateInit(&stream) != Z_OK) {
-    throw std::runtime_error("inflateInit failed");
-  }
-
-  std::string decompressed;
-  char buffer[4096];
-
+  // Inflate straight into the result, growing it as needed
+  std::string decompressed(std::max<size_t>(4096, compressed.size() * 2),
+                           '\0');
+  size_t used = 0;
   while (true) {
-    stream.next_out = reinterpret_cast<Bytef *>(buffer);
-    stream.avail_out = sizeof(buffer);
+    if (used == decompressed.size())
+      decompressed.resize(decompressed.size() * 2);
+    stream.next_out = reinterpret_cast<Bytef *>(&decompressed[used]);
+    stream.avail_out = static_cast<uInt>(decompressed.size() - used);
 
     int ret = inflate(&stream, Z_NO_FLUSH);
-
-    decompressed.append(buffer, sizeof(buffer) - stream.avail_out);
+    used = decompressed.size() - stream.avail_out;
 
     if (ret == Z_STREAM_END) {
       break;
     }
     if (ret != Z_OK) {
-      inflateEnd(&stream);
       throw std::runtime_error("inflate failed");
     }
   }
 
-  inflateEnd(&stream);
+  decompressed.resize(used);
   return decompressed;
 }
 
-std::string readGitObject(const std::string &hash) {
-  std::string filePath =
-      ".verz/objects/" + hash.substr(0, 2) + "/" + hash.substr(2);
+std::string readGitObject(const ObjectId &id) {
+  std::string filePath = getObjectPath(id);
 
   std::ifstream file(filePath, std::ios::binary);
   if (!file) {
+    std::string packed;
+    if (readPackedObject(id, packed))
+      return packed;
+    // Partial clones fetch objects they were promised on first use
+    if (fetch_promised_objects({id}) && readPackedObject(id, packed))
+      return packed;
     throw std::runtime_error("Failed to open file: " + filePath);
   }
 
-  std::vector<char> compressed{std::istreambuf_iterator<char>(file),
-                               std::istreambuf_iterator<char>()};
-  file.close();
+  file.seekg(0, std::ios::end);
+  std::string compressed(static_cast<size_t>(file.tellg()), '\0');
+  file.seekg(0);
+  file.read(&compressed[0], compressed.size());
+  return zlibDecompress(compressed);
+}
+
+std::string readGitObject(const std::string &hash) {
+  ObjectId id;
+  if (!ObjectId::parse_hex(hash, id))
+    throw std::runtime_error("Failed to open file: " + getObjectPath(hash));
+  return readGitObject(id);
+}
+
+bool readObjectInfo(const ObjectId &id, std::string &type, uint64_t &size) {
+  std::ifstream file(getObjectPath(id), std::ios::binary);
+  if (!file) {
+    uint8_t code;
+    if (packedObjectInfo(id, code, size) ||
+        (fetch_promised_objects({id}) &&
+         packedObjectInfo(id, code, size))) {
+      type = packTypeName(code);
+      return true;
+    }
+    return false;
+  }
+
+  // "<type> <size>\0" fits in 32 bytes; feed the compressed file in small
+  // pieces until the NUL comes out
+  z_stream &stream = reusableInflater();
+  char in[64];
+  char header[32];
+  stream.next_out = reinterpret_cast<Bytef *>(header);
+  stream.avail_out = sizeof(header);
+  const char *nul = nullptr;
+  while (!nul && stream.avail_out > 0) {
+    if (stream.avail_in == 0) {
+      file.read(in, sizeof(in));
+      if (file.gcount() == 0)
+        break;
+      stream.next_in = reinterpret_cast<Bytef *>(in);
+      stream.avail_in = static_cast<uInt>(file.gcount());
+    }
+    int ret = inflate(&stream, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      throw std::runtime_error("inflate failed");
+    nul = static_cast<const char *>(
+        std::memchr(header, '\0', sizeof(header) - stream.avail_out));
+    if (ret == Z_STREAM_END)
+      break;
+  }
 
-  std::string compressedStr(compressed.begin(), compressed.end());
-  return zlibDecompress(compressedStr);
+  const char *space =
+      nul ? static_cast<const char *>(std::memchr(header, ' ', nul - header))
+          : nullptr;
+  if (!space)
+    throw std::runtime_error("Malformed object: " + id.hex());
+  type.assign(header, space - header);
+  size = std::stoull(std::string(space + 1, nul));
+  return true;
+}
+
+bool readObjectInfo(const std::string &hash, std::string &type,
+                    uint64_t &size) {
+  ObjectId id;
+  return ObjectId::parse_hex(hash, id) && readObjectInfo(id, type, size);
 }
 
 std::string calcSHA1(const std::string &content) {
   unsigned char hash[20];
   SHA1(reinterpret_cast<const unsigned char *>(content.c_str()), content.size(),
        hash);
-
-  std::stringstream ss;
-  for (int i = 0; i < 20; i++) {
-    ss << std::hex << std::setw(2) << std::setfill('0')
-       << static_cast<int>(hash[i]);
-  }
-  return ss.str();
+  std::string hex(40, '\0');
+  hexEncode(hash, sizeof(hash), &hex[0]);
+  return hex;
 }
 
 std::string getObjectPath(const std::string &hash) {
   return ".verz/objects/" + hash.substr(0, 2) + "/" + hash.substr(2);
 }
 
-bool objectExists(const std::string &hash) {
-  return std::filesystem::exists(getObjectPath(hash));
+std::string getObjectPath(const ObjectId &id) {
+  char hex[ObjectId::HEX_SIZE];
+  id.to_hex(hex);
+  std::string path = ".verz/objects/";
+  path.append(hex, 2).append(1, '/').append(hex + 2, ObjectId::HEX_SIZE - 2);
+  return path;
 }
 
-void writeGitObject(const std::string &content, const std::string &hash) {
-  std::string compressed = zlibCompress(content);
+bool objectExists(const ObjectId &id) {
+  return std::filesystem::exists(getObjectPath(id)) || packedObjectExists(id);
+}
 
-  std::string dir = ".verz/objects/" + hash.substr(0, 2);
-  std::filesystem::create_directories(dir);
+bool objectExists(const std::string &hash) {
+  ObjectId id;
+  return ObjectId::parse_hex(hash, id) && objectExists(id);
+}
 
-  std::ofstream out(dir + "/" + hash.substr(2), std::ios::binary);
-  out.write(compressed.data(), compressed.size());
-  out.close();
+ObjectId createGitObjectId(const std::string &type, const std::string &content,
+                           bool write) {
+  ObjectWriter writer(type, content.size(), write);
+  writer.update(content);
+  return writer.finish_id();
 }
 
 std::string createGitObject(const std::string &type, const std::string &content,
                             bool write) {
-  std::string header = type + " " + std::to_string(content.size());
-  header += '\0';
-
-  std::string object = header + content;
+  return createGitObjectId(type, content, write).hex();
+}
 
-  std::string hash = calcSHA1(object);
+std::string createBlobObject(const std::string &content, bool write) {
+  return createGitObject("blob", content, write);
+}
 
-  if (write) {
-    writeGitObject(object, hash);
+ObjectId createBlobIdFromStream(std::istream &in, uint64_t size, bool write) {
+  ObjectWriter writer("blob", size, write);
+  std::vector<char> chunk(BLOB_READ_CHUNK);
+  for (uint64_t left = size; left > 0;) {
+    size_t want = static_cast<size_t>(std::min<uint64_t>(left, chunk.size()));
+    in.read(chunk.data(), want);
+    if (static_cast<size_t>(in.gcount()) != want)
+      throw std::runtime_error("short read while hashing blob");
+    writer.update(chunk.data(), want);
+    left -= want;
   }
+  return writer.finish_id();
+}
 
-  return hash;
+std::string createBlobFromStream(std::istream &in, uint64_t size,
+                                 bool write) {
+  return createBlobIdFromStream(in, size, write).hex();
 }
 
-std::string createBlobObject(const std::string &content, bool write) {
-  return createGitObject("blob", content, write);
+ObjectId createBlobIdFromFile(const std::string &path, bool write) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("cannot open '" + path + "'");
+  return createBlobIdFromStream(file, std::filesystem::file_size(path), write);
+}
+
+std::string createBlobFromFile(const std::string &path, bool write) {
+  return createBlobIdFromFile(path, write).hex();
+}
+
+ObjectId createTreeId(const std::string &entries, bool write) {
+  return createGitObjectId("tree", entries, write);
 }
 
 std::string createTreeObject(const std::string &entries, bool write) {
-  return createGitObject("tree", entries, write);
+  return createTreeId(entries, write).hex();
 }
@@ -0,0 +1,366 @@
+#!/bin/sh
+# End-to-end tests: local repositories (gc, damaged pack indexes and
+# commit-graphs, the index, write-tree) and clones and fetches against a
+# stand-in smart HTTP server. Needs git (to build and serve the fixture
+# repository) and python3.
+#
+# Usage: tests/run.sh [path/to/verz]
+
+set -u
+
+VERZ=$(realpath "${1:-bin/verz}")
+TESTS=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+SERVER=
+FAILED=0
+COUNT=0
+
+cleanup() {
+  [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+  [ -n "${KEEP:-}" ] || rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+ok() {
+  COUNT=$((COUNT + 1))
+  echo "ok $COUNT - $1"
+}
+
+not_ok() {
+  COUNT=$((COUNT + 1))
+  FAILED=$((FAILED + 1))
+  echo "not ok $COUNT - $1"
+}
+
+# check <description> <command...>: the command's output is shown only if
+# it fails
+check() {
+  desc=$1
+  shift
+  if "$@" >"$TMP/out" 2>&1; then
+    ok "$desc"
+  else
+    not_ok "$desc"
+    sed 's/^/# /' "$TMP/out"
+  fi
+}
+
+# start_server [--v0] [--hide <capability>]...: serves $TMP/srv, sets URL
+# and LOG
+start_server() {
+  [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+  LOG=$TMP/requests.log
+  : >"$LOG"
+  rm -f "$TMP/port"
+  python3 "$TESTS/smart_http_server.py" "$@" "$TMP/srv" "$LOG" "$TMP/port" &
+  SERVER=$!
+  for _ in $(seq 50); do
+    [ -f "$TMP/port" ] && break
+    sleep 0.1
+  done
+  URL=http://127.0.0.1:$(cat "$TMP/port")
+}
+
+# fetch requests the server has answered so far
+posts() {
+  grep -c " fetch " "$LOG"
+}
+
+# nth fetch request
+nth_post() {
+  grep " fetch " "$LOG" | sed -n "$1p"
+}
+
+# ---------------------------------------------------------------------------
+# Fixture: two commits, so the first version of a.txt is reachable but not
+# checked out
+# ---------------------------------------------------------------------------
+
+git init -q "$TMP/src"
+(
+  cd "$TMP/src" &&
+    git config user.name t && git config user.email t@t &&
+    echo old >a.txt && git add a.txt && git commit -qm one &&
+    echo new >a.txt && mkdir dir && echo b >dir/b.txt &&
+    git add . && git commit -qm two
+) || exit 1
+mkdir "$TMP/srv"
+git clone -q --bare "$TMP/src" "$TMP/srv/sample.git" || exit 1
+OLD_BLOB=$(git -C "$TMP/src" rev-parse HEAD~1:a.txt)
+
+# ---------------------------------------------------------------------------
+# Partial clone
+# ---------------------------------------------------------------------------
+
+for protocol in v2 v0; do
+  if [ $protocol = v0 ]; then start_server --v0; else start_server; fi
+  dest=$TMP/partial-$protocol
+
+  check "$protocol: blob:none clone succeeds" \
+    "$VERZ" clone --filter=blob:none "$URL/sample" "$dest"
+  check "$protocol: clone sends the filter" \
+    test "$(nth_post 1)" = \
+    "POST sample.git $protocol fetch wants=1 haves=0 filter=blob:none done=1 ack=-"
+  check "$protocol: clone records the promisor remote" \
+    grep -q "promisor = true" "$dest/.verz/config"
+  check "$protocol: clone records the filter" \
+    grep -q "partialclonefilter = blob:none" "$dest/.verz/config"
+  check "$protocol: clone marks its packs" \
+    test "$(ls "$dest"/.verz/objects/pack/*.promisor | wc -l)" -eq 2
+  check "$protocol: checkout fetches its blobs in one request" \
+    test "$(nth_post 2 | cut -d' ' -f5)" = wants=2
+  check "$protocol: checkout writes the fetched blobs" \
+    test "$(cat "$dest/a.txt") $(cat "$dest/dir/b.txt")" = "new b"
+
+  before=$(posts)
+  check "$protocol: reading a missing blob fetches it" \
+    test "$(cd "$dest" && "$VERZ" cat-file -p "$OLD_BLOB")" = old
+  check "$protocol: missing blob costs one request" \
+    test "$(posts)" -eq $((before + 1))
+  check "$protocol: fetched blob is kept" \
+    test "$(cd "$dest" && "$VERZ" cat-file -p "$OLD_BLOB"; posts)" = "old
+$((before + 1))"
+done
+
+# ---------------------------------------------------------------------------
+# Fetch negotiation with older v0 servers
+# ---------------------------------------------------------------------------
+
+BRANCH=$(git -C "$TMP/src" symbolic-ref --short HEAD)
+
+# fetch_against <name> <expected ack request> <server options...>: clones,
+# adds a commit on the server and fetches it
+fetch_against() {
+  name=$1
+  mode=$2
+  shift 2
+  start_server --v0 "$@"
+  dest=$TMP/fetch-$name
+  check "$name: clone succeeds" "$VERZ" clone "$URL/sample" "$dest"
+  check "$name: server gets a new commit" sh -c "
+    cd '$TMP/src' && echo $name >$name.txt && git add $name.txt &&
+      git commit -qm $name && git push -q '$TMP/srv/sample.git' $BRANCH"
+  : >"$LOG"
+  check "$name: fetch succeeds" sh -c "cd '$dest' && '$VERZ' fetch"
+  cp "$TMP/out" "$TMP/fetch.out"
+  # The new commit, its tree and its blob, plus any delta bases a thin pack
+  # leaves out; a fetch without haves gets the whole history
+  check "$name: fetch receives only new objects" \
+    awk '/^Received/ { n = $2 } END { exit !(n > 0 && n <= 4) }' \
+    "$TMP/fetch.out"
+  check "$name: fetch updates the remote branch" \
+    test "$(cat "$dest/.verz/refs/remotes/origin/$BRANCH")" = \
+    "$(git -C "$TMP/src" rev-parse HEAD)"
+  check "$name: fetch asks for ack mode $mode" \
+    test "$(nth_post 1 | sed 's/.* ack=//')" = "$mode"
+  check "$name: fetch sends haves" \
+    test "$(nth_post 1 | cut -d' ' -f6)" != haves=0
+  check "$name: fetch ends with done" \
+    test "$(nth_post "$(posts)" | cut -d' ' -f8)" = done=1
+}
+
+fetch_against multi_ack_detailed multi_ack_detailed
+fetch_against multi_ack multi_ack --hide multi_ack_detailed
+fetch_against single_ack - --hide multi_ack_detailed --hide multi_ack
+
+# ---------------------------------------------------------------------------
+# Local repository: gc round trip
+# ---------------------------------------------------------------------------
+
+REPO=$TMP/local
+mkdir "$REPO"
+cd "$REPO" || exit 1
+"$VERZ" init >/dev/null && "$VERZ" register t t@t || exit 1
+for i in 1 2 3; do
+  mkdir -p "dir$i/sub"
+  echo "top $i" >top.txt
+  echo "file $i" >"dir$i/sub/f.txt"
+  seq 1 200 | sed "s/^/line $i /" >"dir$i/big.txt"
+  "$VERZ" add . >/dev/null && "$VERZ" commit -m "commit $i" >/dev/null ||
+    exit 1
+done
+
+# Every object and its content, as cat-file prints it
+dump_objects() {
+  for id in $(cat "$TMP/objects"); do
+    echo "$id $("$VERZ" cat-file -t "$id")"
+    "$VERZ" cat-file -p "$id"
+  done
+}
+
+find .verz/objects -type f -path '*/objects/??/*' |
+  sed 's|.*/objects/\(..\)/|\1|' | sort >"$TMP/objects"
+dump_objects >"$TMP/before.objects"
+"$VERZ" log >"$TMP/before.log"
+
+check "gc succeeds" "$VERZ" gc
+check "gc packs every loose object" \
+  test "$(find .verz/objects -type f -path '*/objects/??/*' | wc -l)" -eq 0
+check "gc writes one pack and its index" \
+  test "$(ls .verz/objects/pack/*.pack .verz/objects/pack/*.idx | wc -l)" -eq 2
+check "gc writes a commit-graph" test -s .verz/objects/info/commit-graph
+dump_objects >"$TMP/after.objects" 2>&1
+check "objects read back unchanged from the pack" \
+  cmp "$TMP/before.objects" "$TMP/after.objects"
+check "log is unchanged after gc" \
+  sh -c "'$VERZ' log | cmp '$TMP/before.log' -"
+check "cat-file --batch-check reads the pack" \
+  sh -c "'$VERZ' cat-file --batch-check <'$TMP/objects' | grep -c missing |
+    grep -qx 0"
+
+# ---------------------------------------------------------------------------
+# Damaged pack index and commit-graph
+# ---------------------------------------------------------------------------
+
+IDX=$(ls .verz/objects/pack/*.idx)
+GRAPH=.verz/objects/info/commit-graph
+cp "$IDX" "$TMP/good.idx"
+cp "$GRAPH" "$TMP/good.graph"
+HEAD_COMMIT=$(cat ".verz/$(sed 's/^ref: //' .verz/HEAD)")
+
+# damaged_idx <description> <expected error> <python statement on d>: the
+# lookup must fail cleanly (exit 1, no crash) with the expected message
+damaged_idx() {
+  python3 -c "
+import sys
+d = bytearray(open(sys.argv[1], 'rb').read())
+$3
+open(sys.argv[1], 'wb').write(d)" "$IDX" || not_ok "$1: damaging the file"
+  check "$1: cat-file exits 1" sh -c "
+    '$VERZ' cat-file -t $HEAD_COMMIT >'$TMP/idx.out' 2>&1; test \$? -eq 1"
+  check "$1: cat-file reports it" grep -q "$2" "$TMP/idx.out"
+  cp "$TMP/good.idx" "$IDX"
+}
+
+damaged_idx "truncated .idx" "Truncated pack index" "d = d[:1100]"
+damaged_idx ".idx with a non-monotonic fanout" "Non-monotonic pack index" \
+  "d[8 + 4 * 10:8 + 4 * 11] = b'\xff\xff\xff\xff'"
+# Every offset points into a 64-bit table the file does not have
+damaged_idx ".idx with a bad large offset" "Corrupt pack index" "
+n = int.from_bytes(d[8 + 1020:8 + 1024], 'big')
+offsets = 8 + 1024 + n * 24
+for i in range(n):
+    d[offsets + 4 * i:offsets + 4 * i + 4] = (0x80000005).to_bytes(4, 'big')"
+check "intact .idx reads again" "$VERZ" cat-file -t "$HEAD_COMMIT"
+
+# damaged_graph <description> <python statement on d>: log must fall back to
+# the commit objects and print the same history
+damaged_graph() {
+  python3 -c "
+import hashlib, sys
+d = bytearray(open(sys.argv[1], 'rb').read())
+$2
+open(sys.argv[1], 'wb').write(d)" "$GRAPH" || not_ok "$1: damaging the file"
+  check "$1: log is unchanged" sh -c "'$VERZ' log | cmp '$TMP/before.log' -"
+  cp "$TMP/good.graph" "$GRAPH"
+}
+
+damaged_graph "truncated commit-graph" "d = d[:100]"
+damaged_graph "commit-graph with a bad checksum" "d[1060] ^= 0xff"
+# Valid checksum, but fanout[255] claims more commits than OIDL and CDAT
+# hold; the OIDF offset sits in the first chunk-table row
+damaged_graph "commit-graph with an inflated count" "
+oidf = int.from_bytes(d[12:20], 'big')
+d[oidf + 1020:oidf + 1024] = (0x00ffffff).to_bytes(4, 'big')
+d[-20:] = hashlib.sha1(d[:-20]).digest()"
+# Valid checksum, but the newest commit's first parent is out of range
+damaged_graph "commit-graph with a bad parent position" "
+oidf = int.from_bytes(d[12:20], 'big')
+oidl = int.from_bytes(d[24:32], 'big')
+cdat = int.from_bytes(d[36:44], 'big')
+n = int.from_bytes(d[oidf + 1020:oidf + 1024], 'big')
+head = bytes.fromhex('$HEAD_COMMIT')
+pos = [bytes(d[oidl + 20 * i:oidl + 20 * i + 20]) for i in range(n)].index(head)
+d[cdat + 36 * pos + 20:cdat + 36 * pos + 24] = (n + 5).to_bytes(4, 'big')
+d[-20:] = hashlib.sha1(d[:-20]).digest()"
+
+# ---------------------------------------------------------------------------
+# Racy index entries
+# ---------------------------------------------------------------------------
+
+# index_entry <path>: "<mtime seconds> <blob>" from .verz/index (DIRC v2)
+index_entry() {
+  python3 -c "
+import sys
+d = open('.verz/index', 'rb').read()
+pos = 12
+for _ in range(int.from_bytes(d[8:12], 'big')):
+    flags = int.from_bytes(d[pos + 60:pos + 62], 'big')
+    path = d[pos + 62:pos + 62 + (flags & 0xfff)].decode()
+    if path == sys.argv[1]:
+        print(int.from_bytes(d[pos + 8:pos + 12], 'big'), d[pos + 40:pos + 60].hex())
+    pos += (62 + len(path) + 8) // 8 * 8" "$1"
+}
+
+# A file stamped in the future is never older than the index written after
+# it, so its cached stat cannot be trusted
+FUTURE=$(($(date +%s) + 3600))
+printf aaaa >racy.txt
+touch -d "@$FUTURE" racy.txt
+"$VERZ" add racy.txt >/dev/null
+check "racy entry is staged" \
+  test "$(index_entry racy.txt | cut -d' ' -f2)" = \
+  "$(git hash-object racy.txt)"
+echo other >other.txt
+"$VERZ" add other.txt >/dev/null
+check "racy entry's cached mtime is cleared when the index is rewritten" \
+  test "$(index_entry racy.txt | cut -d' ' -f1)" -eq 0
+# Same size, same mtime: only a re-hash can notice the change
+printf bbbb >racy.txt
+touch -d "@$FUTURE" racy.txt
+"$VERZ" add racy.txt >/dev/null
+check "racy entry with unchanged size and mtime is re-hashed" \
+  test "$(index_entry racy.txt | cut -d' ' -f2)" = \
+  "$(git hash-object racy.txt)"
+echo fresh >fresh.txt
+touch -d "@$(($(date +%s) - 60))" fresh.txt
+"$VERZ" add fresh.txt >/dev/null
+check "entry older than the index keeps its cached mtime" \
+  test "$(index_entry fresh.txt | cut -d' ' -f1)" -ne 0
+
+# ---------------------------------------------------------------------------
+# write-tree over files it cannot read
+# ---------------------------------------------------------------------------
+
+WT=$TMP/write-tree
+mkdir -p "$WT/sub"
+cd "$WT" || exit 1
+"$VERZ" init >/dev/null || exit 1
+echo a >a.txt
+echo b >sub/b.txt
+check "write-tree succeeds" sh -c "'$VERZ' write-tree >'$TMP/tree'"
+mkfifo fifo
+check "write-tree skips a FIFO" sh -c "
+  timeout 10 '$VERZ' write-tree | cmp '$TMP/tree' -"
+rm fifo
+
+# Root reads anything, so the unreadable case runs as nobody when needed
+if [ "$(id -u)" -ne 0 ]; then
+  AS_USER=
+elif command -v setpriv >/dev/null; then
+  AS_USER="setpriv --reuid 65534 --regid 65534 --clear-groups"
+  chmod a+rx "$TMP"
+  chmod -R a+rwX "$WT"
+else
+  AS_USER=skip
+fi
+if [ "$AS_USER" = skip ]; then
+  ok "# skip write-tree over an unreadable file (root without setpriv)"
+else
+  echo secret >sub/secret.txt
+  chmod 000 sub/secret.txt
+  trees_before=$(find .verz/objects -type f | wc -l)
+  check "write-tree over an unreadable file exits 1" sh -c "
+    $AS_USER '$VERZ' write-tree >'$TMP/wt.out' 2>&1; test \$? -eq 1"
+  check "write-tree names the unreadable file" \
+    grep -q "^fatal: cannot open '.*sub/secret.txt'" "$TMP/wt.out"
+  check "write-tree prints no tree for it" \
+    test "$(grep -c '^[0-9a-f]\{40\}$' "$TMP/wt.out")" -eq 0
+  check "write-tree writes no tree missing an entry" \
+    test "$(find .verz/objects -type f | wc -l)" -eq "$trees_before"
+  rm -f sub/secret.txt
+fi
+cd "$TESTS" || exit 1
+
+echo "$COUNT tests, $FAILED failed"
+[ "$FAILED" -eq 0 ]
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""Stand-in smart HTTP server for the tests.
+
+Serves the bare repositories under ROOT the way `git http-backend` does,
+but runs `git upload-pack --stateless-rpc` directly so only git itself is
+needed. Filtering and wanting any object are always allowed, as partial
+clones require. Each upload-pack request is appended to LOG as one line:
+
+    POST <repo> v<protocol> <command> wants=<n> haves=<n> filter=<spec> done=<0|1> ack=<mode>
+
+where <command> is ls-refs or fetch (always fetch for v0), and <mode> is
+the v0 ACK capability the client asked for, or - for none.
+
+Usage: smart_http_server.py [--v0] [--hide CAP]... ROOT LOG PORT_FILE
+
+The server binds an ephemeral port and writes it to PORT_FILE once it is
+listening. --v0 ignores the client's Git-Protocol header; --hide drops a
+capability from the v0 advertisement, to play an older server.
+"""
+import argparse
+import http.server
+import os
+import subprocess
+import urllib.parse
+
+UPLOAD_PACK = ["git", "-c", "uploadpack.allowFilter=true",
+               "-c", "uploadpack.allowAnySHA1InWant=true", "upload-pack",
+               "--stateless-rpc"]
+
+
+def pkt_line(data):
+    return b"%04x" % (len(data) + 4) + data
+
+
+def pkt_lines(body):
+    """Payloads of the pkt-lines in body; flush and delim packets skipped."""
+    pos = 0
+    while pos + 4 <= len(body):
+        size = int(body[pos:pos + 4], 16)
+        if size < 4:
+            pos += 4
+            continue
+        yield body[pos + 4:pos + size].rstrip(b"\n")
+        pos += size
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    root = ""
+    log = ""
+    force_v0 = False
+    hidden = []
+
+    def protocol(self):
+        header = self.headers.get("Git-Protocol", "")
+        return "" if self.force_v0 else header
+
+    def repo(self, suffix):
+        path = urllib.parse.urlsplit(self.path).path
+        if not path.endswith(suffix):
+            return None
+        repo = os.path.join(self.root, path[1:-len(suffix)])
+        return repo if os.path.isdir(repo) else None
+
+    def reply(self, status, content_type, body):
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def upload_pack(self, repo, args, body=b""):
+        env = dict(os.environ, GIT_PROTOCOL=self.protocol())
+        return subprocess.run(UPLOAD_PACK + args + [repo], input=body,
+                              env=env, capture_output=True, check=True).stdout
+
+    def do_GET(self):
+        query = urllib.parse.urlsplit(self.path).query
+        repo = self.repo("/info/refs")
+        if repo is None or query != "service=git-upload-pack":
+            self.reply(404, "text/plain", b"not found\n")
+            return
+        body = self.upload_pack(repo, ["--advertise-refs"])
+        # v0 advertisements start with the service line; v2 ones do not
+        if "version=2" not in self.protocol():
+            body = pkt_line(b"# service=git-upload-pack\n") + b"0000" + \
+                self.hide_capabilities(body)
+        self.reply(200, "application/x-git-upload-pack-advertisement", body)
+
+    def hide_capabilities(self, body):
+        """Drops the hidden capabilities from the first ref line."""
+        size = int(body[:4], 16)
+        ref, _, caps = body[4:size].rstrip(b"\n").partition(b"\0")
+        kept = [cap for cap in caps.split()
+                if cap.split(b"=")[0].decode() not in self.hidden]
+        return pkt_line(ref + b"\0" + b" ".join(kept) + b"\n") + body[size:]
+
+    def do_POST(self):
+        repo = self.repo("/git-upload-pack")
+        if repo is None:
+            self.reply(404, "text/plain", b"not found\n")
+            return
+        body = self.read_body()
+        self.record(repo, body)
+        self.reply(200, "application/x-git-upload-pack-result",
+                   self.upload_pack(repo, [], body))
+
+    def read_body(self):
+        if self.headers.get("Transfer-Encoding") != "chunked":
+            return self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        chunks = []
+        while True:
+            size = int(self.rfile.readline().strip(), 16)
+            chunk = self.rfile.read(size)
+            self.rfile.readline()
+            if size == 0:
+                return b"".join(chunks)
+            chunks.append(chunk)
+
+    def record(self, repo, body):
+        lines = list(pkt_lines(body))
+        count = lambda word: sum(line.startswith(word) for line in lines)
+        spec = [line[7:].decode() for line in lines if line.startswith(b"filter ")]
+        version = "2" if "version=2" in self.protocol() else "0"
+        command = "ls-refs" if b"command=ls-refs" in lines else "fetch"
+        caps = lines[0].split()[2:] if lines and version == "0" else []
+        ack = [cap.decode() for cap in caps if cap.startswith(b"multi_ack")]
+        with open(self.log, "a") as f:
+            f.write("POST %s v%s %s wants=%d haves=%d filter=%s done=%d "
+                    "ack=%s\n" %
+                    (os.path.basename(repo), version, command, count(b"want "),
+                     count(b"have "), spec[0] if spec else "-",
+                     int(b"done" in lines), ack[0] if ack else "-"))
+
+    def log_message(self, *args):
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--v0", action="store_true")
+    parser.add_argument("--hide", action="append", default=[])
+    parser.add_argument("root")
+    parser.add_argument("log")
+    parser.add_argument("port_file")
+    args = parser.parse_args()
+    Handler.root, Handler.log = args.root, args.log
+    Handler.force_v0, Handler.hidden = args.v0, args.hide
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+    with open(args.port_file + ".tmp", "w") as f:
+        f.write("%d\n" % server.server_address[1])
+    os.rename(args.port_file + ".tmp", args.port_file)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()